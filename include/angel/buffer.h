@@ -12,27 +12,45 @@ namespace angel {
 // | avail | xxxxxx | avail |
 // +------------------------+
 //         r        w
+//
+// The storage is borrowed from a per-thread pool (see buffer_pool.h)
+// only when there is data, and is returned when readable() hits zero,
+// so an empty buffer holds no memory.
 class buffer {
 public:
     buffer();
     explicit buffer(size_t size);
     ~buffer();
 
-    char *begin() { return &*buf.begin(); }
+    buffer(const buffer& other);
+    buffer& operator=(const buffer& other);
+
+    char *begin() { return buf; }
     char *peek() { return begin() + read_index; }
     char *end() { return begin() + write_index; }
     size_t prependable() const { return read_index; }
     size_t readable() const { return write_index - read_index; }
-    size_t writeable() const { return buf.size() - write_index; }
+    size_t writeable() const { return capacity - write_index; }
+    // The size of the storage.
+    size_t capacity_size() const { return capacity; }
 
     int read_fd(int fd);
+    // Read at least size bytes directly into the buffer, without the extra
+    // copy of read_fd(int), the storage is extended if it is not enough.
+    ssize_t read_fd(int fd, size_t size);
 
     void append(std::string_view s);
     void append(const char *data, size_t len);
+    // Write into end() directly, without an intermediate buffer:
+    // ensure_writeable(len) makes at least len bytes writeable,
+    // and has_written(n) commits the n bytes written.
+    void ensure_writeable(size_t len) { make_space(len); }
+    void has_written(size_t len);
 
     // retrieve read data, peek() += len
     void retrieve(size_t len);
     void retrieve_all() { retrieve(readable()); }
+    // Return an empty string if there is no data.
     const char *c_str();
 
     bool starts_with(std::string_view s)
@@ -54,7 +72,8 @@ public:
     {
         return find(peek(), pattern);
     }
-    int find_crlf() { return find("\r\n"); }
+    // Vectorized (see util::find_crlf())
+    int find_crlf();
     int find_lf() { return find("\n"); }
 
     void swap(buffer& other);
@@ -64,8 +83,10 @@ public:
     }
 private:
     void make_space(size_t len);
+    void release();
 
-    std::vector<char> buf;
+    char *buf = nullptr;
+    size_t capacity = 0;
     size_t read_index = 0;
     size_t write_index = 0;
 };
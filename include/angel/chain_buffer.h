@@ -0,0 +1,79 @@
+#ifndef _ANGEL_CHAIN_BUFFER_H
+#define _ANGEL_CHAIN_BUFFER_H
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <sys/types.h>
+
+struct iovec;
+
+namespace angel {
+
+//
+// A buffer made of a chain of segments.
+//
+// +-------+   +-------+   +-------+
+// | block |-->| slice |-->| block |
+// +-------+   +-------+   +-------+
+//
+// block: A fixed size block allocated from the per-thread buffer pool,
+//        small appended data is copied into it.
+// slice: A piece of external memory (e.g. a std::string), which is
+//        referenced without a copy, and released after being retrieved.
+//
+// Appending never moves the data that has been appended,
+// and all segments can be written by one writev(2).
+//
+class chain_buffer {
+public:
+    static const size_t block_size = 16 * 1024;
+
+    chain_buffer() = default;
+    ~chain_buffer();
+
+    chain_buffer(const chain_buffer&) = delete;
+    chain_buffer& operator=(const chain_buffer&) = delete;
+
+    size_t readable() const { return bytes; }
+    bool empty() const { return bytes == 0; }
+
+    // Copy data into blocks.
+    void append(std::string_view s);
+    void append(const char *data, size_t len);
+    // Reference [data, data + len) without a copy,
+    // the owner is released after all of it has been retrieved.
+    void append(std::shared_ptr<const void> owner, const char *data, size_t len);
+    void append(std::string&& s);
+
+    // Fill at most iovcnt iovecs with the first (at most len) readable bytes.
+    // Returns the number of filled iovecs.
+    int peek(struct iovec *iov, int iovcnt, size_t len) const;
+
+    // If the first segment is a slice, returns its readable bytes,
+    // and *owner is set to its owner, otherwise returns 0.
+    size_t front_slice(std::shared_ptr<const void> *owner) const;
+
+    void retrieve(size_t len);
+    void retrieve_all() { retrieve(readable()); }
+
+    // writev(2) at most len bytes to fd.
+    ssize_t write_fd(int fd, size_t len);
+private:
+    struct segment {
+        const char *data;
+        size_t len;
+        char *block; // Not null if it's a block
+        size_t used; // Only for block
+        std::shared_ptr<const void> owner; // Only for slice
+    };
+
+    std::deque<segment> segs;
+    size_t bytes = 0;
+};
+
+}
+
+#endif // _ANGEL_CHAIN_BUFFER_H
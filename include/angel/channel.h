@@ -2,6 +2,7 @@
 #define __ANGEL_CHANNEL_H
 
 #include <functional>
+#include <cstddef>
 
 namespace angel {
 
@@ -11,6 +12,7 @@ enum event_type {
     Read    = 0x01,
     Write   = 0x02,
     Error   = 0x04,
+    Edge    = 0x08, // Only used to register an edge-triggered fd to dispatcher.
 };
 
 typedef std::function<void()> event_handler_t;
@@ -33,6 +35,10 @@ public:
     channel(const channel&) = delete;
     channel& operator=(const channel&) = delete;
 
+    // Allocated from a slab.
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
+
     int fd() const { return evfd; }
     evloop *get_loop() const { return loop; }
 
@@ -55,6 +61,15 @@ public:
     void disable_read();
     void disable_write();
 
+    // Use edge-triggered mode if the dispatcher supports it (only epoll now),
+    // MUST be called before add().
+    //
+    // Read and Write events are registered only once in add(),
+    // then enable_*() and disable_*() no longer need to modify the dispatcher,
+    // but the handlers must read or write until EAGAIN.
+    void set_edge_triggered(bool on) { edge_triggered = on; }
+    bool is_edge_triggered() const { return edge_triggered; }
+
     void set_read_handler(event_handler_t handler);
     void set_write_handler(event_handler_t handler);
     void set_error_handler(event_handler_t handler);
@@ -65,6 +80,7 @@ private:
     evloop *loop;
     const int evfd;
     bool hold_fd;
+    bool edge_triggered;
     int filter;  // Events of interest associated with evfd.
     int trigger; // Events that have been triggered, returned by I/O Multiplexing.
     event_handler_t read_handler;
@@ -76,6 +92,7 @@ private:
     friend class poll_base_t;
     friend class kqueue_base_t;
     friend class epoll_base_t;
+    friend class io_uring_base_t;
     friend class evloop;
 };
 
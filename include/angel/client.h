@@ -43,6 +43,9 @@ public:
     void set_connection_failure_handler(connection_failure_handler_t handler);
     void set_connection_timeout_handler(int timeout_ms, connection_timeout_handler_t handler);
     void set_high_water_mark_handler(size_t size, high_water_mark_handler_t handler);
+    void set_low_water_mark_handler(size_t size, low_water_mark_handler_t handler);
+    // See connection::set_backpressure()
+    void set_backpressure(bool on) { backpressure = on; }
     void set_message_handler(message_handler_t handler);
     void set_close_handler(close_handler_t handler);
     // select by angel if thread_nums = 0
@@ -70,11 +73,14 @@ private:
     connection_failure_handler_t connection_failure_handler;
     connection_timeout_handler_t connection_timeout_handler;
     high_water_mark_handler_t high_water_mark_handler;
+    low_water_mark_handler_t low_water_mark_handler;
     message_handler_t message_handler;
     close_handler_t close_handler;
     size_t connection_timeout_timer_id;
     int connection_timeout; // ms
     size_t high_water_mark;
+    size_t low_water_mark;
+    bool backpressure;
     friend class ssl_client;
 };
 
@@ -6,9 +6,11 @@
 #include <atomic>
 #include <any> // only c++17
 #include <queue>
+#include <deque>
 
 #include <angel/channel.h>
 #include <angel/buffer.h>
+#include <angel/chain_buffer.h>
 #include <angel/inet_addr.h>
 
 namespace angel {
@@ -27,9 +29,20 @@ typedef std::function<void(const connection_ptr&, buffer&)> message_handler_t;
 typedef std::function<void(const connection_ptr&)> close_handler_t;
 // Called when the data to be sent accumulates to a certain threshold.
 typedef std::function<void(const connection_ptr&)> high_water_mark_handler_t;
+// Called when the data to be sent drops to a certain threshold,
+// after it has reached the high water mark.
+typedef std::function<void(const connection_ptr&)> low_water_mark_handler_t;
 // Called after all previous data has been sent.
 typedef std::function<void(const connection_ptr&)> send_complete_handler_t;
 
+// Read statistics of a connection.
+struct read_stats {
+    size_t reads = 0;       // Number of read(2) returning data
+    size_t bytes = 0;       // Total bytes read
+    size_t full_reads = 0;  // Number of reads getting all they asked for
+    size_t read_size = 0;   // Current size of a read
+};
+
 //
 // A higher-level encapsulation than channel,
 // and manage TCP (or UDP) connections exclusively.
@@ -39,6 +52,8 @@ public:
     // The chl->fd() must be the fd returned by accept(2) or connect(2),
     // and the TCP connection has been successfully established.
     connection(size_t id, class channel *chl);
+    // The peer address is known (e.g. returned by accept(2)).
+    connection(size_t id, class channel *chl, const inet_addr& peer_addr);
     virtual ~connection();
 
     connection(const connection&) = delete;
@@ -76,8 +91,17 @@ public:
 
     // (thread-safe)
     void send(std::string_view s);
+    void send(const char *s);
     void send(const char *s, size_t len);
     void send(const void *v, size_t len);
+    // Transfer the ownership of data to the connection, so it is never copied,
+    // even if it is sent by other threads or can not be sent at once.
+    // It will be released after being sent. (thread-safe)
+    void send(std::string&& s);
+    void send(std::unique_ptr<char[]> data, size_t len);
+    // Send [data, data + len) owned by owner without a copy (e.g. a cached response),
+    // owner is released after being sent. (thread-safe)
+    void send(std::shared_ptr<const void> owner, const char *data, size_t len);
     // (thread-safe)
     void format_send(const char *fmt, ...);
     // send_file() async-sends the specified file by zero copy. (thread-safe)
@@ -89,6 +113,35 @@ public:
     //
     // Or after send(), you can also do something with it.
     void set_send_complete_handler(const send_complete_handler_t handler);
+    // In cork mode, nothing is written immediately by send() and send_file(),
+    // all pending data is flushed together at the end of the current loop
+    // iteration, so several sends for a response (e.g. header, body and trailer)
+    // go out in one writev(2) and fewer TCP segments. (thread-safe)
+    void set_cork(bool on);
+
+    // Stop and restart reading from the connection. (thread-safe)
+    // For example, a proxy can pause reading from the upstream while the
+    // downstream is slow (in its high water mark handler), and resume
+    // in its low water mark handler.
+    void pause_read();
+    void resume_read();
+
+    // Read until the socket is drained (a short read) in one Read event,
+    // instead of one read per event in level-triggered mode.
+    // It saves the poll for a fast sender. (not thread-safe)
+    void set_read_drain(bool on) { read_drain = on; }
+    // (not thread-safe, call it in the io loop thread)
+    const read_stats& get_read_stats() const { return rstats; }
+    // Send the data owned by the connection (send(std::string&&) and so on),
+    // which is at least threshold bytes, by MSG_ZEROCOPY (linux >= 4.14).
+    // The pages are not copied into the kernel, and the owner is released
+    // (and the send complete handler is called) after the kernel notifies
+    // that it has finished with them.
+    //
+    // It only pays off for large payloads (e.g. >= 16 KiB),
+    // 0 means disabled (by default). (thread-safe)
+    // It's ignored if the loop uses io_uring (see evloop_options::use_io_uring).
+    void set_zerocopy(size_t threshold);
 
     // Generally, they are only invoked by server and client,
     // and can not be called directly, unless you want to override
@@ -96,6 +149,11 @@ public:
     void set_message_handler(message_handler_t handler);
     void set_close_handler(close_handler_t handler);
     void set_high_water_mark_handler(size_t size, high_water_mark_handler_t handler);
+    void set_low_water_mark_handler(size_t size, low_water_mark_handler_t handler);
+    // Stop reading while the data to be sent is above the high water mark,
+    // and restart when it drops to the low water mark (0 by default),
+    // so the memory of a connection with a slow reader is bounded.
+    void set_backpressure(bool on) { backpressure = on; }
 private:
     enum state_t { Connected, Closing, Closed };
 
@@ -103,19 +161,56 @@ private:
     bool is_closed() const { return state == Closed; }
 
     void handle_read();
+    // The data received by the multishot recv of io_uring.
+    void handle_recv(const char *data, ssize_t n);
+    // Handle the data held by handle_recv() while reading was paused.
+    void handle_held_recv();
+    void handle_eof();
+    void update_read_size(size_t n);
     void handle_write();
+    bool send_queued();
+    // n bytes of the first byte stream have been sent.
+    void retrieve_sent(size_t n);
+    // Submit the first byte stream to io_uring, one is in flight at a time.
+    void submit_send(size_t len);
+    void handle_send_completion(ssize_t n);
     void handle_close(bool is_forced);
     void handle_error();
+    void handle_error_event();
     void force_close_connection();
+    ssize_t try_write(const char *data, size_t len);
     void send_in_loop(const char *data, size_t len);
+    // The unsent data is referenced by output_buf without a copy.
+    void send_in_loop(std::string&& data);
+    void send_in_loop(std::unique_ptr<char[]> data, size_t len);
+    void send_in_loop(std::shared_ptr<const void> owner, const char *data, size_t len);
+    void queue_output(size_t len);
+    // Enable the Write event, or schedule a flush in cork mode (and with io_uring sends).
+    void start_write();
+    void update_writing();
+    void flush_corked();
     void send_file_in_loop(int fd, off_t offset, off_t count);
     void set_ttl_timer();
     void update_ttl_timer();
+    // Publish the change of queued bytes to the load of loop.
+    void add_queued_bytes(int64_t n);
+    // Enable or disable the Read event by read_paused and backpressure_paused.
+    void update_reading();
+    void check_low_water_mark();
     const char *get_state_str();
 
     virtual void handle_message();
     virtual ssize_t write(const char *data, size_t len);
+    virtual ssize_t writev(const struct iovec *iov, int iovcnt);
     virtual ssize_t sendfile(int fd, off_t offset, off_t count);
+    bool use_zerocopy(size_t len) const;
+    virtual ssize_t write_zerocopy(const char *data, size_t len,
+                                   const std::shared_ptr<const void>& owner);
+    // The data accepted by write() but not written to the socket yet
+    // (e.g. the encrypted records of ssl_connection), it is sent first.
+    virtual bool has_pending_output() const { return false; }
+    // Returns false if something is still left.
+    virtual bool flush_pending_output() { return true; }
 
     evloop *loop;
     channel *channel;
@@ -133,23 +228,54 @@ private:
         off_t count;
     };
     buffer input_buf;
-    buffer output_buf;
-    // pair<send_id, output_buf offset len>
+    chain_buffer output_buf;
+    int64_t queued_bytes;
+    // pair<send_id, len of the byte stream in output_buf>
     std::queue<std::pair<size_t, size_t>> byte_stream_queue;
     std::queue<std::pair<size_t, file>> send_file_queue;
     std::queue<std::pair<size_t, send_complete_handler_t>> send_complete_handler_queue;
-    bool send_queue_is_empty() { return byte_stream_queue.empty() && send_file_queue.empty(); }
+    bool send_queue_is_empty()
+    {
+        return byte_stream_queue.empty() && send_file_queue.empty() && !has_pending_output();
+    }
     // Increment id, assigned to each send task.
     // (send byte stream) or (send file)
     size_t send_id;
     // Id of the next send task to be processed.
     size_t next_id;
+    bool corked;
+    // Has a flush_corked() been deferred ?
+    bool flush_pending;
+    // The byte streams are sent by io_uring, and are batched like the cork mode,
+    // so the sends of all connections in a loop iteration are submitted together.
+    bool uring_send;
+    bool send_inflight;
+    // Is there data received while reading was paused ?
+    bool recv_held;
 
     std::atomic_bool reset_by_peer;
     message_handler_t message_handler;
     close_handler_t close_handler;
     high_water_mark_handler_t high_water_mark_handler;
     size_t high_water_mark;
+    low_water_mark_handler_t low_water_mark_handler;
+    size_t low_water_mark;
+    // Has the data to be sent reached the high water mark,
+    // and not dropped to the low water mark yet ?
+    bool above_high_water_mark;
+    bool backpressure;
+    bool read_paused; // By pause_read()
+    bool backpressure_paused;
+    size_t zerocopy_threshold;
+    // Number of zerocopy sends, which is the same as the kernel.
+    uint32_t zerocopy_seq;
+    // pair<seq, owner of the data>, waiting for the completion notifications.
+    std::deque<std::pair<uint32_t, std::shared_ptr<const void>>> zerocopy_pending;
+    // Size of the next read, adapted to the recent reads.
+    size_t read_size;
+    bool shrink_pending;
+    bool read_drain;
+    read_stats rstats;
 
     friend class ssl_connection;
 };
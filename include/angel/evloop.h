@@ -4,27 +4,82 @@
 #include <memory>
 #include <functional>
 #include <thread>
-#include <mutex>
+#include <atomic>
 #include <vector>
-#include <unordered_map>
 
 #include <angel/channel.h>
+#include <angel/task_queue.h>
 
 namespace angel {
 
 class dispatcher;
+class io_uring_base_t;
+struct buffer_counters;
 
 class timer_t;
 typedef std::function<void()> timer_callback_t;
 
 typedef std::function<void()> functor;
 
+struct evloop_options {
+    // The data structure used to manage timers.
+    // set:   Balanced binary tree, add and cancel a timer is O(log n).
+    // wheel: Hierarchical timing wheel, add, cancel and refresh a timer is O(1).
+    //        It is suitable for a large number of timers which are frequently
+    //        refreshed, such as the idle ttl of connections.
+    enum class timer_type { set, wheel };
+    timer_type timer = timer_type::set;
+    // The maximum number of expired timers executed in one loop iteration,
+    // the rest will be executed in the next iteration without blocking.
+    // This prevents a large batch of timers from starving I/O events.
+    // 0 means no limit.
+    size_t max_timers_per_tick = 1024;
+    // Use linux io_uring as the I/O multiplexing if it is supported,
+    // otherwise use the default one (epoll, kqueue, poll or select).
+    // The connections of the loop receive and send by io_uring too,
+    // instead of read(2) and writev(2) after readiness events.
+    bool use_io_uring = false;
+};
+
+// Timer statistics of an evloop, can be read from any thread.
+struct timer_stats {
+    size_t fired = 0;               // Number of timers executed
+    int64_t total_lateness_ms = 0;  // Sum of (actual - scheduled) execution time
+    int64_t max_lateness_ms = 0;
+    size_t exhausted_ticks = 0;     // Number of times max_timers_per_tick was reached
+};
+
+// Load of an evloop, published by the connections living in it.
+// It's cheap to update and read (relaxed atomics) from any thread,
+// and is used to select an io loop for a new connection.
+struct loop_load {
+    std::atomic_size_t connections{0};
+    std::atomic<int64_t> queued_bytes{0}; // Bytes queued for sending (including files)
+};
+
+// Memory held by the buffers allocated in the thread of an evloop,
+// can be read from any thread.
+struct buffer_stats {
+    int64_t in_use_bytes = 0;   // Held by buffers
+    int64_t cached_bytes = 0;   // Held by the free lists of the buffer pool
+};
+
+// How to select an io loop for a new connection.
+enum class placement_policy {
+    round_robin,
+    least_connections,
+    least_queued_bytes,
+    // Select the one with fewer connections of two random loops,
+    // which only reads two loops, but is almost as balanced as least_connections.
+    power_of_two_choices,
+};
+
 ////////////////////////////////////////
 // The event loop, the core of angel. //
 ////////////////////////////////////////
 class evloop {
 public:
-    evloop();
+    explicit evloop(evloop_options ops = evloop_options());
     ~evloop();
 
     evloop(const evloop&) = delete;
@@ -36,6 +91,10 @@ public:
     // Quit the event loop. (thread-safe)
     // It will return immediately without waiting for the evloop to exit.
     void quit();
+    // Execute the cb at the end of the current loop iteration,
+    // after all triggered events and queued tasks have been handled.
+    // (It must be called in the io loop thread)
+    void defer(functor cb) { deferred_functors.push_back(std::move(cb)); }
 
     ////////////////////////////////////////////////////////////
     // The following public member functions are thread-safe. //
@@ -45,9 +104,26 @@ public:
     bool is_io_loop_thread();
     // Execute user callback on io loop thread.
     // Execute immediately if is_io_loop_thread() else queue_in_loop().
-    void run_in_loop(functor cb);
+    template <typename F>
+    void run_in_loop(F&& cb)
+    {
+        if (!is_io_loop_thread()) {
+            queue_in_loop(std::forward<F>(cb));
+        } else {
+            cb();
+        }
+    }
     // Put the cb into the task queue of the io loop thread.
-    void queue_in_loop(functor cb);
+    template <typename F>
+    void queue_in_loop(F&& cb)
+    {
+        functors.push(std::forward<F>(cb));
+        // We don't have to wakeup() every time,
+        // just wakeup() when the io loop thread may be blocked.
+        if (!wakeup_pending.exchange(true)) {
+            wakeup();
+        }
+    }
 
     // Execute the cb after timeout (ms),
     // and a timer id is returned, that can be used to cancel a timer.
@@ -57,35 +133,58 @@ public:
     size_t run_every(int64_t interval_ms, timer_callback_t cb);
     // Cancel a timer by id.
     void cancel_timer(size_t id);
+    // Reschedule a timer to execute after timeout (ms) from now.
+    // It is cheaper than cancel_timer() and then run_after() again.
+    void refresh_timer(size_t id, int64_t timeout_ms);
+    // A high lateness means the loop is overloaded,
+    // and timers (such as the ttl of connections) can not be executed in time.
+    timer_stats get_timer_stats() const;
+    loop_load& get_load() { return load; }
+    buffer_stats get_buffer_stats() const;
 private:
     void do_functors();
+    void do_deferred_functors();
 
     void wakeup_init();
     void wakeup_close();
     void wakeup_read();
-    void wakeup(uint8_t);
+    void wakeup();
 
     // Used by dispatcher.
-    channel *search_channel(int fd);
+    channel *search_channel(int fd) { return channel_map[fd].get(); }
 
     std::unique_ptr<dispatcher> dispatcher;
+    // Not null if the dispatcher is io_uring, which also provides
+    // completion-based accept, recv and send.
+    io_uring_base_t *uring;
     std::unique_ptr<timer_t> timer;
-    std::unordered_map<int, std::unique_ptr<channel>> channel_map;
+    loop_load load;
+    // Counters of the buffer pool of the io loop thread.
+    buffer_counters *buf_counters;
+    // Fds are small dense integers, so we index channels by fd directly.
+    std::vector<std::unique_ptr<channel>> channel_map;
     std::vector<channel*> active_channels;
     const std::thread::id cur_tid;
     // A task queue for transferring tasks
     // from non-io threads to io threads for execution.
-    std::vector<functor> functors;
-    std::mutex mtx;
+    task_queue functors;
+    // Tasks queued by defer(), only accessed in the io loop thread.
+    std::vector<functor> deferred_functors;
+    // Has wakeup() been called since the last do_functors() ?
+    std::atomic_bool wakeup_pending;
+    // An eventfd (both are the same fd) if supported, otherwise a socketpair.
     int wake_pair[2];
     channel *wake_channel;
-    bool is_quit;
+    std::atomic_bool is_quit;
 
     friend class select_base_t;
     friend class poll_base_t;
     friend class kqueue_base_t;
     friend class epoll_base_t;
+    friend class io_uring_base_t;
     friend class channel;
+    friend class listener_t;
+    friend class connection;
 };
 
 } // angel
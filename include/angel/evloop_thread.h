@@ -12,7 +12,8 @@ namespace angel {
 // One-loop-per-thread
 class evloop_thread {
 public:
-    evloop_thread() : loop(nullptr)
+    explicit evloop_thread(evloop_options ops = evloop_options())
+        : loop(nullptr), ops(ops)
     {
         auto f = barrier.get_future();
         std::thread t(&evloop_thread::thread_func, this);
@@ -36,7 +37,7 @@ public:
 private:
     void thread_func()
     {
-        evloop t_loop;
+        evloop t_loop(ops);
         loop = &t_loop;
         barrier.set_value();
         loop->run();
@@ -49,6 +50,7 @@ private:
     }
 
     evloop *loop;
+    evloop_options ops;
     std::thread loop_thread;
     std::promise<void> barrier;
 };
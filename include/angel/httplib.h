@@ -2,6 +2,7 @@
 #define __ANGEL_HTTPLIB_H
 
 #include <vector>
+#include <list>
 #include <string>
 #include <mutex>
 #include <future>
@@ -22,7 +23,7 @@ enum Version {
 };
 
 enum Method {
-    OPTIONS, GET, HEAD, POST, PUT, DELETE, TRACE, CONNECT,
+    OPTIONS, GET, HEAD, POST, PUT, DELETE, TRACE, CONNECT, PATCH,
 };
 
 enum StatusCode {
@@ -118,29 +119,87 @@ struct uri {
 //=================== http_server ====================
 //====================================================
 
+// A header field of a request, pointing into the request head.
+struct header_view {
+    std::string_view field;
+    std::string_view value;
+};
+
+// A parameter captured from the path by the router, e.g.
+// { "id", "42" } for "/users/42" if the route is "/users/:id".
+struct route_param {
+    std::string_view name;
+    std::string_view value;
+};
+
+// The request line and the headers are parsed in place: the path is decoded
+// into path(), and the rest are views pointing into the input buffer of the
+// connection, which is not compacted until the request completes.
+// (If the body has to be waited for, the head is copied out of the buffer.)
+//
+// params() and headers() are built on the first call,
+// query() and header() can be used to avoid the copies.
 class request : private message {
 public:
     Method method() const { return req_method; }
     const std::string& path() const { return abs_path; }
     Version version() const { return http_version; }
-    const Params& params() const { return query_params; }
-    const Headers& headers() const { return message::headers; }
+    const Params& params() const;
+    const Headers& headers() const;
+    // The raw (not decoded) query string, e.g. "k1=v1&k2=v2".
+    std::string_view query() const { return query_str; }
+    // Return the value of the field (case-insensitive),
+    // or an empty view if there is no such field.
+    std::string_view header(std::string_view field) const;
+    // All header fields in the order they appear.
+    const std::vector<header_view>& header_list() const { return header_views; }
+    // Return the value of the path parameter of the matched route,
+    // or an empty view if there is no such parameter.
+    std::string_view path_param(std::string_view name) const;
+    const std::vector<route_param>& path_params() const { return route_params; }
     const std::string& body() const { return message::body; }
 private:
-    StatusCode parse_line(buffer& buf);
+    // Parse the request line and the headers at the front of buf,
+    // nothing is retrieved from buf, head_size() bytes should be retrieved
+    // after the request is processed.
+    // Return Ok, Continue (data is not enough), or an error code.
+    StatusCode parse_head(buffer& buf);
+    size_t head_size() const { return head_len; }
     void clear();
+    StatusCode parse_line(std::string_view line);
+    StatusCode parse_fields(std::string_view fields);
+    StatusCode parse_body_length();
+    void own_head(buffer& buf);
+    void remove_header(std::string_view field);
 
     ParseState state = ParseLine;
 
     Method req_method;
     std::string abs_path;
     Version http_version;
-    Params query_params;
+    std::string_view query_str;
+    std::vector<header_view> header_views;
+    // The offsets (from buf.peek()) that parse_head() has reached:
+    // the length of the Request-Line, the start of the current line,
+    // and where to resume scanning for CRLF.
+    size_t line_len = 0;
+    size_t line_pos = 0;
+    size_t scan_pos = 0;
+    size_t head_len = 0;
+    // The copy of the head (see own_head()).
+    std::string head;
+    std::vector<route_param> route_params;
+    mutable Params query_params;
+    mutable bool params_parsed = false;
+    mutable Headers header_map;
+    mutable bool header_map_built = false;
     bool has_file;
     off_t filesize;
     std::string last_modified;
     std::string etag;
     friend class http_server;
+    // Defined by test/bench_http_parse.cc to call parse_head().
+    friend struct request_test;
 };
 
 class response {
@@ -158,8 +217,34 @@ private:
 
     void send(std::string_view body = "");
     void send_err();
+    void write(std::string_view data);
+    void write_file(int fd, off_t offset, off_t count);
+    void close_file(int fd);
+    void flush(bool done);
+    void hold(std::string_view data);
+    void release();
+
+    // A part of the held output: data, [offset, offset + count) of fd,
+    // or closing fd after everything before it has been sent.
+    struct held_part {
+        std::string data;
+        int fd = -1;
+        off_t offset = 0;
+        off_t count = 0;
+        bool close_fd = false;
+    };
 
     connection *conn;
+    // In async mode (see http_server::set_task_threads()), the output is
+    // collected in out, and handed over to the io loop by async_output.
+    std::function<void(std::string&&, bool done)> async_output;
+    std::string out;
+    // The responses ahead of it on the connection have not been sent yet,
+    // so the output is held in held_parts until they are (see context).
+    bool held = false;
+    std::vector<held_part> held_parts;
+    // If not, the connection is closed after the response is sent.
+    bool keepalive = true;
     StatusCode status_code;
     Headers headers;
     std::string buf;
@@ -169,9 +254,39 @@ private:
     friend struct byte_range_set;
 };
 
-struct context {
+typedef std::function<void(request&, response&)> ServerHandler;
+typedef std::function<void(request&, Headers&)> FileHandler;
+
+// A request and its response.
+struct exchange {
     request request;
     response response;
+    // The user handler to run in the task thread pool.
+    const ServerHandler *async_handler = nullptr;
+    // Identify it on the connection, since it is reused by later requests.
+    size_t id = 0;
+    // The user handler is still running (only touched in the io loop).
+    bool handler_running = false;
+    // The response has been completed.
+    bool done = false;
+};
+
+class http_server;
+
+struct context {
+    // The requests being processed on the connection in the order they
+    // arrive, the last one may be still being parsed. Their responses
+    // are sent in the same order, only the front one is sent directly.
+    std::list<exchange> pipeline;
+    // The exchanges to reuse.
+    std::list<exchange> spare;
+    // The input buffer of the connection
+    buffer *input = nullptr;
+    bool read_paused = false;
+    // The id of the next exchange
+    size_t next_id = 0;
+    // The server of the connection
+    http_server *server = nullptr;
 };
 
 enum ConditionCode {
@@ -180,21 +295,71 @@ enum ConditionCode {
     Failed,
 };
 
-typedef std::function<void(request&, response&)> ServerHandler;
-typedef std::function<void(request&, Headers&)> FileHandler;
+// A compressed radix tree of the routes of a method.
+//
+// A route is a path pattern with optional parameters:
+// 1) "/users/:id" matches "/users/42" but not "/users/42/posts",
+//    ":id" captures one non-empty path segment.
+// 2) "/static/*file" matches "/static/" and everything below it,
+//    "*file" captures the rest of the path and must be the last.
+// Static segments take precedence over ":param", which takes precedence
+// over "*wildcard", e.g. "/users/new" wins over "/users/:id".
+class router {
+public:
+    router();
+    ~router();
+    router(router&&);
+    router& operator=(router&&);
+    // If the route is already added, the first handler is kept.
+    void add(std::string_view pattern, ServerHandler handler);
+    // Return the handler of the route matching the path, or nullptr,
+    // the captured parameters are appended to params.
+    const ServerHandler *find(std::string_view path, std::vector<route_param>& params) const;
+private:
+    struct node;
+    static node *insert_static(node *n, std::string_view s);
+    static const ServerHandler *match(const node *n, std::string_view path,
+                                      std::vector<route_param>& params);
+
+    std::unique_ptr<node> root;
+};
 
 class http_server {
 public:
     http_server(evloop *, inet_addr);
+    // The path can be a pattern with parameters (see router),
+    // the captured values are available by request::path_param().
     http_server& Get(std::string_view path, const ServerHandler handler);
     http_server& Post(std::string_view path, const ServerHandler handler);
+    http_server& Put(std::string_view path, const ServerHandler handler);
+    http_server& Delete(std::string_view path, const ServerHandler handler);
+    http_server& Patch(std::string_view path, const ServerHandler handler);
+    http_server& Route(Method method, std::string_view path, const ServerHandler handler);
     http_server& File(std::string_view path, const FileHandler handler);
     // For static file
     void set_base_dir(std::string_view dir);
     // Set parallel threads for request
     void set_parallel(unsigned n);
+    // Run the user handlers (Get(), Post() and so on) in a pool of n task
+    // threads, so that a slow handler doesn't block the io loop.
+    //
+    // The handler may also return before the response is completed
+    // (by set_content(), send_err() or send_done()), and complete it
+    // later from any thread, the request and response are valid until then,
+    // unless the connection is closed first, they are discarded with it.
+    //
+    // The responses of the requests pipelined on a connection are still
+    // sent in order (see set_pipeline_depth()).
+    void set_task_threads(unsigned n);
+    // Set the max number of requests processed ahead on a connection
+    // before the earlier responses are sent, 16 by default.
+    // Reading from the connection is paused when it is reached.
+    void set_pipeline_depth(unsigned n);
     // Set idle time for http connection
     void set_idle(int secs);
+    // Coalesce the header and body of a response into one write
+    // (see connection::set_cork())
+    void set_cork(bool on);
     // Set how to generate file etag
     // 1) default: file mtime "-" file size
     // 2) sha1: file sha1 digest "-" file size
@@ -202,9 +367,14 @@ public:
     void start();
 private:
     void message_handler(const connection_ptr&, buffer&);
-    void process_request(const connection_ptr&, request& req, response& res);
-
-    bool handle_user_router(request& req, response& res);
+    void process_request(exchange& ex);
+    exchange *next_exchange(const connection_ptr&, context& ctx);
+    void send_completed(const connection_ptr&, context& ctx);
+    void run_async(const connection_ptr&, exchange& ex);
+    void finish_async(const connection_ptr&, exchange& ex);
+    void handle_close(const connection_ptr&);
+
+    bool handle_user_router(exchange& ex);
     void handle_file_router(request& req, response& res);
     void handle_static_file_request(request& req, response& res);
     void handle_range_request(request& req, response& res);
@@ -225,12 +395,14 @@ private:
     void delete_file(request& req, response& res);
 
     angel::server server;
-    typedef std::unordered_map<std::string, ServerHandler> Table;
-    std::unordered_map<Method, Table> router;
+    std::unordered_map<Method, router> routers;
     std::unordered_map<std::string, FileHandler> file_table;
     std::string base_dir;
     int idle_time;
     bool generate_file_etag_by_sha1 = false;
+    bool async_handlers = false;
+    size_t pipeline_depth = 16;
+    bool cork = false;
 };
 
 //====================================================
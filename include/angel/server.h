@@ -4,6 +4,8 @@
 #include <unordered_map>
 #include <functional>
 #include <memory>
+#include <vector>
+#include <atomic>
 
 #include <angel/evloop.h>
 #include <angel/connection.h>
@@ -15,11 +17,21 @@ namespace angel {
 class listener_t;
 class evloop_group;
 
+// Statistics of accepted connections, can be read from any thread.
+struct accept_stats {
+    size_t accepted = 0;
+    size_t dropped = 0; // Dropped due to EMFILE
+};
+
 // Server supports several operating modes:
 // 1) [single-threaded reactor]
 // 2) [single-threaded reactor + thread pool] (start_task_threads())
 // 3) [multi-threaded reactor] (start_io_threads())
 // 4) [multi-threaded reactor + thread pool] (start_io_threads(), start_task_threads())
+//
+// In multi-threaded modes, the main loop accepts all connections by default.
+// With set_reuseport(true), every io loop has its own SO_REUSEPORT listener
+// instead, and owns the connections accepted by itself.
 class server {
 public:
     typedef std::function<void(const connection_ptr&)> for_each_functor_t;
@@ -32,16 +44,22 @@ public:
 
     const inet_addr& listen_addr() const;
     // must be call in main-thread
+    // (or the io loop thread owning the connection in reuseport mode)
     connection_ptr get_connection(size_t id);
-    size_t get_connection_nums() const;
+    // (thread-safe)
+    size_t get_connection_nums() const { return conn_nums; }
 
     // traverse one connection by id (thread-safe)
     void for_one(size_t id, const for_each_functor_t functor);
     // traverse all connections (thread-safe)
+    // In reuseport mode, the functor is executed in every io loop thread.
     void for_each(const for_each_functor_t functor);
 
     // select by angel if thread_nums = 0
-    void start_io_threads(size_t thread_nums = 0);
+    // The policy decides which io loop a new connection is placed in,
+    // it does not work in reuseport mode.
+    void start_io_threads(size_t thread_nums = 0, evloop_options ops = evloop_options(),
+                          placement_policy policy = placement_policy::round_robin);
     void start_task_threads(size_t thread_nums = 0,
                             enum thread_pool::policy policy = thread_pool::policy::fixed);
     // execute a task in the task thread pool
@@ -52,6 +70,23 @@ public:
     void set_keepalive_idle(int idle);
     void set_keepalive_intvl(int intvl);
     void set_keepalive_probes(int probes);
+    // Let every io loop accept connections on its own SO_REUSEPORT socket,
+    // so that there is no cross-thread hop per accept.
+    // (It must be set before start(), and takes effect with start_io_threads())
+    void set_reuseport(bool on);
+    // Accept at most n connections for every Read event of the listen socket.
+    // (default 16)
+    void set_accept_batch(size_t n);
+
+    accept_stats get_accept_stats() const;
+    // Register connections in edge-triggered mode if the dispatcher supports it,
+    // which saves an epoll_ctl() whenever the Write event is enabled or disabled.
+    // (It must be set before start(), and is ignored by the servers
+    // not supporting it, see supports_edge_triggered())
+    void set_edge_triggered(bool on) { edge_triggered = on; }
+    // Set all connections in cork mode (see connection::set_cork()).
+    // (It must be set before start())
+    void set_cork(bool on) { cork = on; }
 
     void set_connection_handler(const connection_handler_t handler)
     { connection_handler = std::move(handler); }
@@ -64,17 +99,43 @@ public:
         high_water_mark = size;
         high_water_mark_handler = std::move(handler);
     }
+    void set_low_water_mark_handler(size_t size, const low_water_mark_handler_t handler)
+    {
+        low_water_mark = size;
+        low_water_mark_handler = std::move(handler);
+    }
+    // Pause reading from the connections whose data to be sent is above the
+    // high water mark (see connection::set_backpressure()).
+    void set_backpressure(bool on) { backpressure = on; }
+    // See connection::set_read_drain()
+    void set_read_drain(bool on) { read_drain = on; }
+    // See connection::set_zerocopy()
+    void set_zerocopy(size_t threshold) { zerocopy_threshold = threshold; }
 
     void start();
     void quit();
 
     static void daemon();
 private:
-    channel *make_channel(int fd);
-    virtual connection_ptr create_connection(channel *);
-    virtual void establish(channel *);
+    // All connections accepted by the same listener.
+    struct shard {
+        size_t index;
+        evloop *loop; // The loop accepting and owning connections
+        std::unique_ptr<listener_t> listener; // Only used in reuseport mode
+        std::unordered_map<size_t, connection_ptr> connection_map;
+        std::atomic_size_t next_id{1};
+    };
+
+    channel *make_channel(evloop *io_loop, int fd);
+    virtual connection_ptr create_connection(channel *, const inet_addr& peer_addr);
+    virtual void establish(channel *, const inet_addr& peer_addr);
+    // Whether the connections can be registered in edge-triggered mode.
+    virtual bool supports_edge_triggered() const { return true; }
     void remove_connection(const connection_ptr& conn);
     evloop* get_next_loop();
+    shard *get_shard(evloop *io_loop);
+    // Connection id encodes the index of its shard.
+    size_t new_conn_id(channel *chl);
     void handle_signals();
     void clean_up();
 
@@ -82,13 +143,21 @@ private:
     std::unique_ptr<listener_t> listener;
     std::unique_ptr<evloop_group> io_loop_group;
     std::unique_ptr<thread_pool> task_thread_pool;
-    std::unordered_map<size_t, connection_ptr> connection_map;
-    size_t conn_id;
+    // Declared after io_loop_group, listeners must be removed before io loops quit.
+    std::vector<std::unique_ptr<shard>> shards;
+    std::atomic_size_t conn_nums;
     connection_handler_t connection_handler;
     message_handler_t message_handler;
     close_handler_t close_handler;
     high_water_mark_handler_t high_water_mark_handler;
     size_t high_water_mark;
+    low_water_mark_handler_t low_water_mark_handler;
+    size_t low_water_mark;
+    bool backpressure;
+    bool read_drain;
+    size_t zerocopy_threshold;
+    bool edge_triggered;
+    bool cork;
     // bool is_set_cpu_affinity;
     friend class ssl_server;
 };
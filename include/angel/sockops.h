@@ -29,6 +29,8 @@ int socket(const char *protocol = "tcp");
 void bind(int sockfd, const struct sockaddr_in *addr);
 void listen(int sockfd);
 int accept(int sockfd);
+// The accepted fd is non-blocking and close-on-exec.
+int accept_nonblock(int sockfd, struct sockaddr_in *peer_addr);
 int connect(int sockfd, const struct sockaddr_in *addr);
 
 void set_nonblock(int sockfd);
@@ -46,6 +48,9 @@ const char *to_host(const struct sockaddr_in *addr);
 void set_reuseaddr(int fd, bool on);
 void set_reuseport(int fd, bool on);
 void set_nodelay(int fd, bool on);
+// Allow send_zerocopy() on fd (linux >= 4.14).
+// Returns false if it is not supported.
+bool set_zerocopy(int fd, bool on);
 
 void set_keepalive(int fd, bool on);
 // Setting is effective only after SO_KEEPALIVE is enabled.
@@ -66,6 +71,20 @@ void set_keepalive_probes(int fd, int probes);
 //
 ssize_t sendfile(int fd, int sockfd, off_t offset, off_t count);
 
+// send(2) with MSG_ZEROCOPY, the pages of data are pinned instead of being
+// copied, so they must not be modified or released until the kernel reports
+// the completion of this send. (see recv_zerocopy_completion())
+//
+// Every successful call is numbered in order (starting from 0) by the kernel.
+ssize_t send_zerocopy(int sockfd, const void *data, size_t len);
+// Read a notification from the error queue of sockfd.
+//
+// Returns 1 if the sends numbered in [*lo, *hi] are completed,
+// and *copied is set if the kernel fell back to copying the data.
+// Returns 0 if it is not a zerocopy notification.
+// Returns -1 on error (EAGAIN if there is none).
+int recv_zerocopy_completion(int sockfd, uint32_t *lo, uint32_t *hi, bool *copied);
+
 }
 }
 
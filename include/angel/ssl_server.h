@@ -1,6 +1,8 @@
 #ifndef __ANGEL_SSL_SERVER_H
 #define __ANGEL_SSL_SERVER_H
 
+#include <mutex>
+
 #include <angel/server.h>
 
 namespace angel {
@@ -16,10 +18,18 @@ public:
     void set_certificate_file(const char *cert_file);
     void set_private_key_passwd(const char *key_passwd);
     void set_private_key_file(const char *key_file);
+    // Let the kernel do the record encryption and decryption after the handshake
+    // (kTLS), so that send_file() can use the real sendfile(2).
+    // It silently falls back to the default path if the kernel (tls module),
+    // OpenSSL or the negotiated cipher doesn't support it.
+    void set_ktls(bool on);
 private:
-    connection_ptr create_connection(channel *) override;
-    void establish(channel *) override;
+    connection_ptr create_connection(channel *, const inet_addr&) override;
+    void establish(channel *, const inet_addr&) override;
+    // The ssl handshake relies on level-triggered events.
+    bool supports_edge_triggered() const override { return false; }
     std::unordered_map<int, std::unique_ptr<ssl_handshake>> shmap;
+    std::mutex shmap_lock;
 };
 
 }
@@ -0,0 +1,222 @@
+#ifndef __ANGEL_TASK_QUEUE_H
+#define __ANGEL_TASK_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace angel {
+
+// A callable with small buffer optimization.
+//
+// Most of the tasks transferred between threads are lambdas
+// capturing a few pointers, a shared_ptr or a std::string,
+// they are constructed in place without allocating memory.
+// Larger callables are allocated on the heap.
+class task {
+public:
+    task() = default;
+    ~task() { reset(); }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    template <typename F>
+    void set(F&& f)
+    {
+        typedef typename std::decay<F>::type T;
+        reset();
+        if constexpr (sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t)) {
+            new (buf) T(std::forward<F>(f));
+            invoke_fn = [](void *p){ (*static_cast<T*>(p))(); };
+            destroy_fn = [](void *p){ static_cast<T*>(p)->~T(); };
+        } else {
+            *reinterpret_cast<T**>(buf) = new T(std::forward<F>(f));
+            invoke_fn = [](void *p){ (**static_cast<T**>(p))(); };
+            destroy_fn = [](void *p){ delete *static_cast<T**>(p); };
+        }
+    }
+    void operator()() { invoke_fn(buf); }
+    // Release the resources captured by the callable.
+    void reset()
+    {
+        if (destroy_fn) {
+            destroy_fn(buf);
+            invoke_fn = nullptr;
+            destroy_fn = nullptr;
+        }
+    }
+private:
+    static const size_t inline_size = 64;
+
+    alignas(std::max_align_t) unsigned char buf[inline_size];
+    void (*invoke_fn)(void*) = nullptr;
+    void (*destroy_fn)(void*) = nullptr;
+};
+
+// An intrusive lock-free multi-producer single-consumer queue.
+// (Based on Dmitry Vyukov's intrusive MPSC node-based queue)
+//
+// Any thread can push(), only the owner thread can run().
+//
+// The nodes are preallocated and reused through a lock-free free list,
+// so push() does not need to allocate memory in most cases.
+// If the free list is exhausted, the node will be allocated on the heap.
+class task_queue {
+public:
+    explicit task_queue(size_t capacity = 1024)
+        : capacity(capacity), nodes(new node[capacity]),
+        head(&stub), tail(&stub), free_head(0)
+    {
+        for (size_t i = 0; i < capacity; i++) {
+            nodes[i].index = i;
+            nodes[i].free_next.store(i + 1 < capacity ? i + 1 : nil, std::memory_order_relaxed);
+        }
+        free_head.store(capacity > 0 ? 0 : nil, std::memory_order_relaxed);
+    }
+    ~task_queue()
+    {
+        while (node *n = pop()) release(n);
+    }
+    task_queue(const task_queue&) = delete;
+    task_queue& operator=(const task_queue&) = delete;
+
+    template <typename F>
+    void push(F&& f)
+    {
+        node *n = acquire();
+        n->fn.set(std::forward<F>(f));
+        // Counted before it is linked, so that executed never exceeds pushed.
+        pushed.fetch_add(1, std::memory_order_relaxed);
+        push(n);
+    }
+
+    // Execute the tasks that have been pushed before calling run(),
+    // tasks pushed during the execution will be executed next time.
+    // Returns the number of executed tasks.
+    size_t run()
+    {
+        if (empty()) return 0;
+        size_t limit = pushed.load(std::memory_order_relaxed) - executed;
+        size_t n = 0;
+        while (n < limit) {
+            node *cur = pop();
+            if (!cur) break;
+            cur->fn();
+            release(cur);
+            n++;
+        }
+        executed += n;
+        return n;
+    }
+    // Called by consumer.
+    bool empty() const
+    {
+        return tail == &stub && !stub.next.load(std::memory_order_acquire) &&
+               head.load() == &stub;
+    }
+private:
+    static const uint32_t nil = UINT32_MAX;
+
+    struct node {
+        std::atomic<node*> next{nullptr};
+        task fn;
+        uint32_t index = nil; // nil if allocated on the heap
+        std::atomic<uint32_t> free_next{nil};
+    };
+
+    void push(node *n)
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        node *prev = head.exchange(n);
+        // The queue is inconsistent until prev->next is set.
+        prev->next.store(n, std::memory_order_release);
+    }
+    node *pop()
+    {
+        while (true) {
+            node *cur = tail;
+            node *next = cur->next.load(std::memory_order_acquire);
+            if (cur == &stub) {
+                if (!next) {
+                    if (head.load() == &stub) return nullptr;
+                    // A producer is being pushed.
+                    std::this_thread::yield();
+                    continue;
+                }
+                tail = next;
+                cur = next;
+                next = cur->next.load(std::memory_order_acquire);
+            }
+            if (next) {
+                tail = next;
+                return cur;
+            }
+            if (cur != head.load()) {
+                // A producer is being pushed after cur.
+                std::this_thread::yield();
+                continue;
+            }
+            push(&stub);
+            next = cur->next.load(std::memory_order_acquire);
+            if (next) {
+                tail = next;
+                return cur;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // The free list is a Treiber stack, the top is an index (low 32 bits)
+    // with a tag (high 32 bits) to avoid the ABA problem.
+    node *acquire()
+    {
+        uint64_t top = free_head.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t i = top & 0xffffffff;
+            if (i == nil) return new node();
+            uint64_t next = ((top >> 32) + 1) << 32 |
+                nodes[i].free_next.load(std::memory_order_relaxed);
+            if (free_head.compare_exchange_weak(top, next,
+                        std::memory_order_acquire, std::memory_order_acquire)) {
+                return &nodes[i];
+            }
+        }
+    }
+    void release(node *n)
+    {
+        n->fn.reset();
+        if (n->index == nil) {
+            delete n;
+            return;
+        }
+        uint64_t top = free_head.load(std::memory_order_relaxed);
+        while (true) {
+            n->free_next.store(top & 0xffffffff, std::memory_order_relaxed);
+            uint64_t next = ((top >> 32) + 1) << 32 | n->index;
+            if (free_head.compare_exchange_weak(top, next,
+                        std::memory_order_release, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+
+    const size_t capacity;
+    std::unique_ptr<node[]> nodes;
+    node stub;
+    std::atomic<node*> head; // Producers push to head
+    node *tail; // Consumer pops from tail
+    // The number of tasks pushed, and executed by run() (only by consumer).
+    std::atomic<size_t> pushed{0};
+    size_t executed = 0;
+    std::atomic<uint64_t> free_head;
+};
+
+}
+
+#endif // __ANGEL_TASK_QUEUE_H
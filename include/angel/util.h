@@ -136,6 +136,10 @@ inline const char *search(std::string_view s, std::string_view pattern)
     return p == end ? nullptr : p;
 }
 
+// Return a pointer to the first "\r\n" in [first, last),
+// or last if not found. (SSE2/AVX2 are used if available.)
+const char *find_crlf(const char *first, const char *last);
+
 // if c == ','
 // for [a,b,c,d] return [a][b][c][d]
 inline std::vector<std::string_view> split(std::string_view s, int c)
@@ -17,6 +17,8 @@ public:
     WebSocketServer(evloop *, inet_addr);
     void for_each(const WebSocketHandler handler);
     void start() { server.start(); }
+    // Coalesce the frames sent in one loop iteration (see connection::set_cork())
+    void set_cork(bool on) { server.set_cork(on); }
 
     WebSocketHandler onopen;
     WebSocketHandler onmessage;
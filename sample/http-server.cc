@@ -21,6 +21,10 @@ int main(int argc, char *argv[])
             res.set_status_code(Ok);
             res.set_content("Hello~~");
             });
+    server.Get("/users/:id", [](request& req, response& res){
+            res.set_status_code(Ok);
+            res.set_content(angel::util::concat("user ", req.path_param("id")));
+            });
     server.Post("/login", [](request& req, response& res){
             res.set_status_code(Ok);
             res.set_content("login successfully");
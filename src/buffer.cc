@@ -1,34 +1,81 @@
 #include <angel/buffer.h>
+#include <angel/util.h>
 
 #include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
 
-namespace angel {
+#include "buffer_pool.h"
 
-static const size_t init_size = 1024;
+namespace angel {
 
-buffer::buffer() : buf(init_size)
+buffer::buffer()
 {
 }
 
-buffer::buffer(size_t size) : buf(size)
+buffer::buffer(size_t size)
 {
+    if (size > 0) {
+        capacity = size;
+        buf = buffer_pool::alloc(capacity);
+    }
 }
 
 buffer::~buffer()
 {
+    release();
+}
+
+buffer::buffer(const buffer& other)
+{
+    *this = other;
+}
+
+buffer& buffer::operator=(const buffer& other)
+{
+    if (this != &other) {
+        retrieve_all();
+        append(other.buf + other.read_index, other.readable());
+    }
+    return *this;
+}
+
+void buffer::release()
+{
+    buffer_pool::free(buf);
+    buf = nullptr;
+    capacity = read_index = write_index = 0;
 }
 
 void buffer::make_space(size_t len)
 {
-    if (len > writeable()) {
-        if (len <= writeable() + prependable()) {
-            size_t read_bytes = readable();
-            std::copy(peek(), peek() + read_bytes, begin());
-            read_index = 0;
-            write_index = read_index + read_bytes;
-        } else
-            buf.resize(write_index + len);
+    if (len <= writeable()) return;
+    size_t read_bytes = readable();
+    if (len <= writeable() + prependable()) {
+        std::copy(peek(), peek() + read_bytes, begin());
+    } else {
+        size_t size = read_bytes + len;
+        char *new_buf = buffer_pool::alloc(size);
+        if (read_bytes > 0) std::copy(peek(), peek() + read_bytes, new_buf);
+        buffer_pool::free(buf);
+        buf = new_buf;
+        capacity = size;
     }
+    read_index = 0;
+    write_index = read_bytes;
+}
+
+void buffer::has_written(size_t len)
+{
+    write_index += len;
+    // Nothing is written, don't hold the storage.
+    if (readable() == 0) release();
+}
+
+int buffer::find_crlf()
+{
+    const char *p = util::find_crlf(peek(), end());
+    return p == end() ? -1 : p - peek();
 }
 
 void buffer::append(std::string_view s)
@@ -38,6 +85,7 @@ void buffer::append(std::string_view s)
 
 void buffer::append(const char *data, size_t len)
 {
+    if (len == 0) return;
     make_space(len);
     std::copy(data, data + len, end());
     write_index += len;
@@ -48,12 +96,14 @@ void buffer::retrieve(size_t len)
     if (len < readable()) {
         read_index += len;
     } else {
-        read_index = write_index = 0;
+        // Return the storage to the pool.
+        release();
     }
 }
 
 const char *buffer::c_str()
 {
+    if (readable() == 0) return "";
     make_space(1);
     buf[write_index] = '\0';
     return peek();
@@ -61,7 +111,8 @@ const char *buffer::c_str()
 
 void buffer::swap(buffer& other)
 {
-    buf.swap(other.buf);
+    std::swap(buf, other.buf);
+    std::swap(capacity, other.capacity);
     std::swap(read_index, other.read_index);
     std::swap(write_index, other.write_index);
 }
@@ -90,4 +141,19 @@ int buffer::read_fd(int fd)
     return n;
 }
 
+ssize_t buffer::read_fd(int fd, size_t size)
+{
+    make_space(size);
+    ssize_t n = ::read(fd, end(), writeable());
+    if (n > 0) {
+        write_index += n;
+    } else if (readable() == 0) {
+        // Nothing is read, don't hold the storage.
+        int saved_errno = errno;
+        release();
+        errno = saved_errno;
+    }
+    return n;
+}
+
 }
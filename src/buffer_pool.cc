@@ -0,0 +1,97 @@
+#include "buffer_pool.h"
+
+#include <vector>
+
+namespace angel {
+namespace buffer_pool {
+
+static const size_t min_class_size = 1024;
+static const size_t num_classes = 11; // 1 KiB - 1 MiB
+// The maximum bytes cached by the free list of a size class.
+static const size_t max_cached_bytes = 1024 * 1024;
+
+// Every storage has a header, so that it can be freed
+// without knowing its size and where it is allocated.
+struct header {
+    buffer_counters *owner;
+    size_t size;
+};
+static const size_t header_size = 16;
+static_assert(sizeof(header) <= header_size, "header is too large");
+
+namespace {
+class local_pool {
+public:
+    ~local_pool();
+    std::vector<char*> free_lists[num_classes];
+};
+}
+
+static thread_local local_pool pool;
+// Buffers may be freed after the pool at thread exit.
+static thread_local bool pool_destroyed = false;
+static thread_local buffer_counters *counters = nullptr;
+
+local_pool::~local_pool()
+{
+    for (size_t i = 0; i < num_classes; i++) {
+        for (char *p : free_lists[i]) {
+            counters->cached -= reinterpret_cast<header*>(p)->size;
+            delete []p;
+        }
+    }
+    pool_destroyed = true;
+}
+
+buffer_counters *this_thread_counters()
+{
+    if (!counters) counters = new buffer_counters();
+    return counters;
+}
+
+static size_t size_class(size_t size)
+{
+    size_t i = 0;
+    for (size_t n = min_class_size; n < size; n <<= 1) i++;
+    return i;
+}
+
+char *alloc(size_t& size)
+{
+    size_t i = size_class(size);
+    size = i < num_classes ? min_class_size << i : size;
+    auto *c = this_thread_counters();
+    char *p = nullptr;
+    if (i < num_classes && !pool_destroyed && !pool.free_lists[i].empty()) {
+        p = pool.free_lists[i].back();
+        pool.free_lists[i].pop_back();
+        c->cached -= size;
+    } else {
+        p = new char[header_size + size];
+    }
+    auto *h = reinterpret_cast<header*>(p);
+    h->owner = c;
+    h->size  = size;
+    c->in_use += size;
+    return p + header_size;
+}
+
+void free(char *ptr)
+{
+    if (!ptr) return;
+    char *p = ptr - header_size;
+    auto *h = reinterpret_cast<header*>(p);
+    size_t size = h->size;
+    h->owner->in_use -= size;
+    size_t i = size_class(size);
+    if (i < num_classes && !pool_destroyed &&
+        (pool.free_lists[i].size() + 1) * size <= max_cached_bytes) {
+        pool.free_lists[i].push_back(p);
+        this_thread_counters()->cached += size;
+    } else {
+        delete []p;
+    }
+}
+
+}
+}
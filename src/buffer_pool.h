@@ -0,0 +1,39 @@
+#ifndef __ANGEL_BUFFER_POOL_H
+#define __ANGEL_BUFFER_POOL_H
+
+#include <atomic>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace angel {
+
+// Memory used by buffers allocated in a thread.
+struct buffer_counters {
+    std::atomic<int64_t> in_use{0}; // Held by buffers
+    std::atomic<int64_t> cached{0}; // Held by free lists of the pool
+};
+
+// A per-thread size-class allocator for the storage of buffers.
+//
+// Sizes are rounded up to a power of two (1 KiB - 1 MiB), and the freed
+// storage is cached in the free list of its size class, larger storage
+// is allocated and freed directly.
+//
+// Storage can be freed in any thread, it is returned to the pool of
+// the freeing thread, and is still accounted to the allocating thread.
+namespace buffer_pool {
+
+// Returns storage of at least size bytes,
+// and size is updated to the real capacity.
+char *alloc(size_t& size);
+void free(char *ptr);
+
+// The counters of current thread, it is never released,
+// so it can be read after the thread exits.
+buffer_counters *this_thread_counters();
+
+}
+}
+
+#endif // __ANGEL_BUFFER_POOL_H
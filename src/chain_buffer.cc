@@ -0,0 +1,120 @@
+#include <angel/chain_buffer.h>
+
+#include <sys/uio.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "buffer_pool.h"
+
+namespace angel {
+
+static char *get_block()
+{
+    size_t size = chain_buffer::block_size;
+    return buffer_pool::alloc(size);
+}
+
+static void put_block(char *block)
+{
+    buffer_pool::free(block);
+}
+
+// The maximum number of iovecs passed to one writev(2).
+static const int max_iovcnt = 64;
+
+chain_buffer::~chain_buffer()
+{
+    for (auto& seg : segs) {
+        if (seg.block) put_block(seg.block);
+    }
+}
+
+void chain_buffer::append(std::string_view s)
+{
+    append(s.data(), s.size());
+}
+
+void chain_buffer::append(const char *data, size_t len)
+{
+    bytes += len;
+    while (len > 0) {
+        if (segs.empty() || !segs.back().block || segs.back().used == block_size) {
+            char *block = get_block();
+            segs.push_back({ block, 0, block, 0, nullptr });
+        }
+        auto& seg = segs.back();
+        size_t n = std::min(len, block_size - seg.used);
+        memcpy(seg.block + seg.used, data, n);
+        seg.used += n;
+        seg.len  += n;
+        data += n;
+        len  -= n;
+    }
+}
+
+void chain_buffer::append(std::shared_ptr<const void> owner, const char *data, size_t len)
+{
+    if (len == 0) return;
+    bytes += len;
+    segs.push_back({ data, len, nullptr, 0, std::move(owner) });
+}
+
+void chain_buffer::append(std::string&& s)
+{
+    // Copy small strings, it's cheaper than a slice.
+    if (s.size() < 1024) {
+        append(s.data(), s.size());
+        return;
+    }
+    auto owner = std::make_shared<std::string>(std::move(s));
+    append(owner, owner->data(), owner->size());
+}
+
+int chain_buffer::peek(struct iovec *iov, int iovcnt, size_t len) const
+{
+    int i = 0;
+    for (auto it = segs.begin(); it != segs.end() && i < iovcnt && len > 0; ++it) {
+        size_t n = std::min(len, it->len);
+        iov[i].iov_base = const_cast<char*>(it->data);
+        iov[i].iov_len  = n;
+        len -= n;
+        i++;
+    }
+    return i;
+}
+
+size_t chain_buffer::front_slice(std::shared_ptr<const void> *owner) const
+{
+    if (segs.empty() || segs.front().block) return 0;
+    *owner = segs.front().owner;
+    return segs.front().len;
+}
+
+void chain_buffer::retrieve(size_t len)
+{
+    len = std::min(len, bytes);
+    bytes -= len;
+    while (len > 0) {
+        auto& seg = segs.front();
+        size_t n = std::min(len, seg.len);
+        seg.data += n;
+        seg.len  -= n;
+        len -= n;
+        if (seg.len > 0) break;
+        // An emptied block is returned to the pool, even if it is the last one,
+        // so that an idle connection holds no memory.
+        if (seg.block) put_block(seg.block);
+        segs.pop_front();
+    }
+}
+
+ssize_t chain_buffer::write_fd(int fd, size_t len)
+{
+    struct iovec iov[max_iovcnt];
+    int iovcnt = peek(iov, max_iovcnt, len);
+    return ::writev(fd, iov, iovcnt);
+}
+
+}
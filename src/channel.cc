@@ -2,6 +2,8 @@
 
 #include <unistd.h>
 
+#include <atomic>
+
 #include <angel/evloop.h>
 #include <angel/util.h>
 #include <angel/logger.h>
@@ -23,8 +25,86 @@ static const char *ev2str(int events)
     }
 }
 
+namespace {
+
+// All channels are allocated from the slab of the thread,
+// so that they are close to each other in memory.
+// A channel may be freed by another thread (e.g. created by the acceptor
+// and freed by the io loop), then the slot is pushed to the remote free list
+// of the slab owning it, which is taken by the owner when it runs out of slots.
+class channel_slab {
+public:
+    void *alloc()
+    {
+        if (!free_list) {
+            free_list = remote_free_list.exchange(nullptr, std::memory_order_acquire);
+        }
+        if (!free_list) {
+            char *chunk = new char[SlotSize * ChunkSize];
+            for (size_t i = 0; i < ChunkSize; i++) {
+                auto *h = reinterpret_cast<slot_header*>(chunk + i * SlotSize);
+                h->owner = this;
+                auto *s = reinterpret_cast<slot*>(chunk + i * SlotSize + HeaderSize);
+                s->next = free_list;
+                free_list = s;
+            }
+        }
+        auto *s = free_list;
+        free_list = s->next;
+        return s;
+    }
+    // Called by any thread, this is the slab of the calling thread.
+    void free(void *ptr)
+    {
+        auto *s = static_cast<slot*>(ptr);
+        auto *h = reinterpret_cast<slot_header*>(static_cast<char*>(ptr) - HeaderSize);
+        if (h->owner == this) {
+            s->next = free_list;
+            free_list = s;
+            return;
+        }
+        auto *owner = h->owner;
+        s->next = owner->remote_free_list.load(std::memory_order_relaxed);
+        while (!owner->remote_free_list.compare_exchange_weak(s->next, s,
+                    std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+private:
+    struct slot_header { channel_slab *owner; };
+    struct slot { slot *next; };
+    static const size_t ChunkSize = 256;
+    static const size_t HeaderSize = alignof(std::max_align_t);
+    static const size_t SlotSize = HeaderSize + ((sizeof(channel) + alignof(std::max_align_t) - 1)
+                                   & ~(alignof(std::max_align_t) - 1));
+    slot *free_list = nullptr;
+    // The slots freed by other threads.
+    std::atomic<slot*> remote_free_list{nullptr};
+};
+
+// Never destroyed, channels may be freed after the destruction
+// of thread_local and static objects.
+thread_local channel_slab *slab = nullptr;
+
+channel_slab *this_thread_slab()
+{
+    if (!slab) slab = new channel_slab;
+    return slab;
+}
+}
+
+void *channel::operator new(size_t size)
+{
+    Assert(size == sizeof(channel));
+    return this_thread_slab()->alloc();
+}
+
+void channel::operator delete(void *ptr)
+{
+    if (ptr) this_thread_slab()->free(ptr);
+}
+
 channel::channel(evloop *loop, int fd, bool hold_fd)
-    : loop(loop), evfd(fd), hold_fd(hold_fd), filter(0), trigger(0)
+    : loop(loop), evfd(fd), hold_fd(hold_fd), edge_triggered(false), filter(0), trigger(0)
 {
     Assert(loop);
     Assert(fd >= 0);
@@ -42,9 +122,16 @@ void channel::add()
 {
     loop->run_in_loop([this]{
             log_debug("channel(fd=%d) is added to the loop(%p)", evfd, loop);
-            auto r = loop->channel_map.emplace(evfd, this);
+            resize_if(evfd, loop->channel_map);
             // MUST NOT add duplicate channel.
-            Assert(r.second);
+            Assert(!loop->channel_map[evfd]);
+            loop->channel_map[evfd].reset(this);
+            if (edge_triggered && !loop->dispatcher->has_edge_triggered()) {
+                edge_triggered = false;
+            }
+            if (edge_triggered) {
+                loop->dispatcher->add(evfd, Read | Write | Edge);
+            }
             enable_read();
             });
 }
@@ -57,7 +144,7 @@ void channel::remove()
     // and instead use queue_in_loop().
     loop->queue_in_loop([this]{
             log_debug("channel(fd=%d) is removed from the loop(%p)", evfd, loop);
-            loop->channel_map.erase(evfd);
+            loop->channel_map[evfd].reset();
             });
 }
 
@@ -65,7 +152,7 @@ void channel::enable_read()
 {
     if (!is_reading()) {
         filter |= Read;
-        loop->dispatcher->add(evfd, Read);
+        if (!edge_triggered) loop->dispatcher->add(evfd, Read);
         log_debug("channel(fd=%d) enable <Read>", evfd);
     }
 }
@@ -74,7 +161,7 @@ void channel::disable_read()
 {
     if (is_reading()) {
         filter &= ~Read;
-        loop->dispatcher->remove(evfd, Read);
+        if (!edge_triggered) loop->dispatcher->remove(evfd, Read);
         log_debug("channel(fd=%d) disable <Read>", evfd);
     }
 }
@@ -83,7 +170,7 @@ void channel::enable_write()
 {
     if (!is_writing()) {
         filter |= Write;
-        loop->dispatcher->add(evfd, Write);
+        if (!edge_triggered) loop->dispatcher->add(evfd, Write);
         log_debug("channel(fd=%d) enable <Write>", evfd);
     }
 }
@@ -92,25 +179,30 @@ void channel::disable_write()
 {
     if (is_writing()) {
         filter &= ~Write;
-        loop->dispatcher->remove(evfd, Write);
+        if (!edge_triggered) loop->dispatcher->remove(evfd, Write);
         log_debug("channel(fd=%d) disable <Write>", evfd);
     }
 }
 
 void channel::disable_all()
 {
-    if (filter) {
-        loop->dispatcher->remove(evfd, filter);
+    int events = edge_triggered ? (Read | Write | Edge) : filter;
+    if (events) {
+        loop->dispatcher->remove(evfd, events);
         log_debug("channel(fd=%d) disable %s", evfd, ev2str(filter));
         read_handler  = nullptr;
         write_handler = nullptr;
         error_handler = nullptr;
         filter = 0;
+        edge_triggered = false;
     }
 }
 
 void channel::handle_event()
 {
+    // Both Read and Write are registered in edge-triggered mode,
+    // ignore the events we are not interested in.
+    if (edge_triggered) trigger &= (filter | Error);
     if (!trigger) return;
     log_debug("channel(fd=%d) triggered event %s", fd(), ev2str(trigger));
     if (trigger & Error)
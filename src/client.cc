@@ -10,7 +10,9 @@ namespace angel {
 client::client(evloop *loop, inet_addr peer_addr, client_options ops)
     : loop(loop), ops(ops), peer_addr(peer_addr),
     connection_timeout_timer_id(0),
-    high_water_mark(0)
+    high_water_mark(0),
+    low_water_mark(0),
+    backpressure(false)
 {
     Assert(loop);
 }
@@ -39,6 +41,8 @@ void client::establish(channel *chl)
     log_info("client(id=%zu, fd=%d) connected to host (%s)", cli_conn->id(), chl->fd(), peer_addr.to_host());
     cli_conn->set_message_handler(message_handler);
     cli_conn->set_high_water_mark_handler(high_water_mark, high_water_mark_handler);
+    cli_conn->set_low_water_mark_handler(low_water_mark, low_water_mark_handler);
+    cli_conn->set_backpressure(backpressure);
     cli_conn->set_close_handler([this](const connection_ptr& conn){
             this->shutdown(conn);
             });
@@ -164,6 +168,12 @@ void client::set_high_water_mark_handler(size_t size, high_water_mark_handler_t
     high_water_mark_handler = std::move(handler);
 }
 
+void client::set_low_water_mark_handler(size_t size, low_water_mark_handler_t handler)
+{
+    low_water_mark = size;
+    low_water_mark_handler = std::move(handler);
+}
+
 void client::start_task_threads(size_t thread_nums, enum thread_pool::policy policy)
 {
     if (thread_nums > 0) {
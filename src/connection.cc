@@ -3,30 +3,78 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 
 #include <future>
+#include <algorithm>
 
 #include <angel/evloop.h>
 #include <angel/sockops.h>
 #include <angel/logger.h>
 #include <angel/util.h>
+#include <angel/config.h>
+
+#if defined (ANGEL_HAVE_IO_URING)
+#include "uring.h"
+#endif
 
 namespace angel {
 
+// The maximum number of iovecs passed to one writev(2).
+static const int max_iovcnt = 64;
+
+// The range of the size of a read(2).
+static const size_t min_read_size  = 1024;
+static const size_t init_read_size = 4096;
+static const size_t max_read_size  = 64 * 1024;
+// In drain mode, the maximum number of reads for one Read event,
+// so that a fast sender can not starve other connections.
+static const int max_drain_reads = 16;
+
 connection::connection(size_t id, class channel *chl)
+    : connection(id, chl, inet_addr(sockops::get_peer_addr(chl->fd())))
+{
+}
+
+connection::connection(size_t id, class channel *chl, const inet_addr& peer_addr)
     : loop(chl->get_loop()),
     channel(chl),
     conn_id(id),
     state(Connected),
     local_addr(sockops::get_local_addr(chl->fd())),
-    peer_addr(sockops::get_peer_addr(chl->fd())),
+    peer_addr(peer_addr),
     ttl_timer_id(0), ttl_ms(0),
+    queued_bytes(0),
     send_id(1), next_id(1),
-    high_water_mark(0)
+    corked(false), flush_pending(false),
+    uring_send(false), send_inflight(false), recv_held(false),
+    high_water_mark(0),
+    low_water_mark(0),
+    above_high_water_mark(false),
+    backpressure(false),
+    read_paused(false),
+    backpressure_paused(false),
+    zerocopy_threshold(0),
+    zerocopy_seq(0),
+    read_size(init_read_size),
+    shrink_pending(false),
+    read_drain(false)
 {
+    loop->get_load().connections.fetch_add(1, std::memory_order_relaxed);
     channel->set_read_handler([this]{ this->handle_read(); });
     channel->set_write_handler([this]{ this->handle_write(); });
-    channel->set_error_handler([this]{ this->handle_error(); });
+    channel->set_error_handler([this]{ this->handle_error_event(); });
+#if defined (ANGEL_HAVE_IO_URING)
+    if (loop->uring) {
+        uring_send = loop->uring->has_send();
+        // The connection may be created in another thread (e.g. by the acceptor).
+        loop->run_in_loop([this]{
+                loop->uring->set_recv_handler(channel->fd(), [this](const char *data, ssize_t n){
+                        this->handle_recv(data, n);
+                        });
+                });
+    }
+#endif
     log_info("connection(id=%zu, fd=%d) is %s", id, channel->fd(), get_state_str());
 }
 
@@ -64,25 +112,106 @@ void connection::force_close_connection()
 
 void connection::handle_read()
 {
-    ssize_t n = input_buf.read_fd(channel->fd());
-    log_debug("Read (%zd) bytes from connection(id=%zu, fd=%d)", n, conn_id, channel->fd());
+    // In edge-triggered mode, we must read until EAGAIN,
+    // otherwise we will not be notified again for the remaining data.
+    for (int reads = 1; ; reads++) {
+        ssize_t n = input_buf.read_fd(channel->fd(), read_size);
+        log_debug("Read (%zd) bytes from connection(id=%zu, fd=%d)", n, conn_id, channel->fd());
+        if (n > 0) {
+            // The buffer is filled, there may be more data.
+            bool filled = input_buf.writeable() == 0;
+            update_read_size(n);
+            if (message_handler) {
+                handle_message();
+            } else {
+                // If the user does not set a message handler, discard all read data.
+                input_buf.retrieve_all();
+            }
+            // The message handler may pause reading.
+            if (is_closed() || !channel->is_reading()) break;
+            if (channel->is_edge_triggered()) continue;
+            // A short read means the socket has been drained.
+            if (!read_drain || !filled || reads >= max_drain_reads) break;
+        } else if (n == 0) {
+            handle_eof();
+            break;
+        } else {
+            if (!channel->is_edge_triggered() || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                handle_error();
+            }
+            break;
+        }
+    }
+    update_ttl_timer();
+}
+
+void connection::handle_recv(const char *data, ssize_t n)
+{
+    if (is_closed()) return;
+    log_debug("Recv (%zd) bytes from connection(id=%zu, fd=%d)", n, conn_id, channel->fd());
     if (n > 0) {
-        if (message_handler) {
+        input_buf.append(data, n);
+        rstats.reads++;
+        rstats.bytes += n;
+        // The data was received before the cancellation of the recv
+        // took effect, hold it until reading is resumed.
+        if (!channel->is_reading()) {
+            recv_held = true;
+        } else if (message_handler) {
             handle_message();
         } else {
-            // If the user does not set a message handler, discard all read data.
             input_buf.retrieve_all();
         }
     } else if (n == 0) {
-        reset_by_peer = true;
-        force_close_connection();
-        reset_by_peer = false;
+        if (recv_held) handle_held_recv();
+        handle_eof();
     } else {
+        errno = -n;
         handle_error();
     }
     update_ttl_timer();
 }
 
+void connection::handle_held_recv()
+{
+    recv_held = false;
+    if (message_handler) {
+        handle_message();
+    } else {
+        input_buf.retrieve_all();
+    }
+}
+
+void connection::handle_eof()
+{
+    reset_by_peer = true;
+    force_close_connection();
+    reset_by_peer = false;
+}
+
+// Like the adaptive receive buffer of netty, the size of the next read
+// is doubled if the last read got all it asked for, and halved if two
+// successive reads got less than half of it, so that small messages
+// don't hold a large buffer, and large ones don't need many reads.
+void connection::update_read_size(size_t n)
+{
+    rstats.reads++;
+    rstats.bytes += n;
+    if (n >= read_size) {
+        rstats.full_reads++;
+        read_size = std::min(read_size * 2, max_read_size);
+        shrink_pending = false;
+    } else if (n <= read_size / 2) {
+        if (shrink_pending) {
+            read_size = std::max(read_size / 2, min_read_size);
+        }
+        shrink_pending = !shrink_pending;
+    } else {
+        shrink_pending = false;
+    }
+    rstats.read_size = read_size;
+}
+
 void connection::handle_message()
 {
     message_handler(shared_from_this(), input_buf);
@@ -90,6 +219,11 @@ void connection::handle_message()
 
 // Whenever the registered sockfd is writable,
 // handle_write() is responsible for sending the unsent data to the peer.
+//
+// The send tasks are flushed greedily until the socket send buffer is full
+// or nothing is left, instead of one task per writable event, so that many
+// small queued sends don't take many loop iterations to drain.
+// (This is also required in edge-triggered mode.)
 void connection::handle_write()
 {
     if (is_closed()) {
@@ -97,50 +231,131 @@ void connection::handle_write()
                  conn_id, channel->fd(), get_state_str());
         return;
     }
-    if (!channel->is_writing()) return;
+    while (send_queued() && !is_closed()) ;
+    if (is_closed()) return;
+    check_low_water_mark();
+    update_writing();
+}
 
+// Disable the Write event if there is nothing to send,
+// otherwise enable it (e.g. the socket send buffer is full).
+void connection::update_writing()
+{
+    // The completion of the io_uring send will go on sending.
+    if (send_inflight) {
+        channel->disable_write();
+        return;
+    }
+    // The send complete handlers are waiting for the completions
+    // of zerocopy sends, instead of the Write event.
+    bool waiting = !zerocopy_pending.empty();
+    if (send_queue_is_empty() && (send_complete_handler_queue.empty() || waiting)) {
+        channel->disable_write();
+        if (is_closing() && !waiting) force_close_connection();
+    } else {
+        channel->enable_write();
+    }
+}
+
+// Send the next send task in order of send_id.
+// Returns true if any progress is made, so that the next one can be tried.
+bool connection::send_queued()
+{
+    if (send_inflight) return false;
+    if (has_pending_output() && !flush_pending_output()) return false;
     if (!byte_stream_queue.empty() && byte_stream_queue.front().first == next_id) {
-        auto& len = byte_stream_queue.front().second;
-        ssize_t n = write(output_buf.peek(), len);
-        if (n > 0) {
-            len -= n;
-            output_buf.retrieve(n);
-            if (len == 0) {
-                log_debug("Send complete for byte stream(send_id=%zu)", next_id);
-                byte_stream_queue.pop();
-                next_id++;
-            }
-        } else if (n == -2) {
-            return;
+        // Consecutive byte streams have been merged into one task (see queue_output()),
+        // so they are written by one writev(2).
+        size_t len = byte_stream_queue.front().second;
+        ssize_t n;
+        std::shared_ptr<const void> owner;
+        size_t slice_len = std::min(output_buf.front_slice(&owner), len);
+        if (uring_send && !use_zerocopy(slice_len)) {
+            submit_send(len);
+            return false;
+        }
+        if (use_zerocopy(slice_len)) {
+            struct iovec iov;
+            output_buf.peek(&iov, 1, slice_len);
+            n = write_zerocopy(static_cast<const char*>(iov.iov_base), slice_len, owner);
+        } else {
+            struct iovec iov[max_iovcnt];
+            int iovcnt = output_buf.peek(iov, max_iovcnt, len);
+            n = writev(iov, iovcnt);
         }
+        if (n <= 0) return false;
+        retrieve_sent(n);
+        return true;
     }
     if (!send_file_queue.empty() && send_file_queue.front().first == next_id) {
         auto& f = send_file_queue.front().second;
         ssize_t n = sendfile(f.fd, f.offset, f.count);
-        if (n > 0) {
-            f.offset += n;
-            f.count  -= n;
-            if (f.count == 0) {
-                log_debug("Send complete for file stream(send_id=%zu, fd=%d)", next_id, f.fd);
-                send_file_queue.pop();
-                next_id++;
-            }
-        } else if (n == -2) {
-            return;
+        if (n <= 0) return false;
+        f.offset += n;
+        f.count  -= n;
+        add_queued_bytes(-n);
+        if (f.count == 0) {
+            log_debug("Send complete for file stream(send_id=%zu, fd=%d)", next_id, f.fd);
+            send_file_queue.pop();
+            next_id++;
         }
+        return true;
     }
     if (!send_complete_handler_queue.empty() &&
         send_complete_handler_queue.front().first == next_id) {
-        send_complete_handler_queue.front().second(shared_from_this());
+        // The memory of zerocopy sends may still be used by the kernel.
+        if (!zerocopy_pending.empty()) return false;
+        // The handler may send more data or close the connection.
+        auto handler = std::move(send_complete_handler_queue.front().second);
         send_complete_handler_queue.pop();
         next_id++;
+        handler(shared_from_this());
+        return true;
     }
-    if (send_queue_is_empty() && send_complete_handler_queue.empty()) {
-        channel->disable_write();
-        if (is_closing()) force_close_connection();
+    return false;
+}
+
+void connection::retrieve_sent(size_t n)
+{
+    auto& len = byte_stream_queue.front().second;
+    len -= n;
+    output_buf.retrieve(n);
+    add_queued_bytes(-static_cast<int64_t>(n));
+    if (len == 0) {
+        log_debug("Send complete for byte stream(send_id=%zu)", next_id);
+        byte_stream_queue.pop();
+        next_id++;
     }
 }
 
+void connection::submit_send(size_t len)
+{
+#if defined (ANGEL_HAVE_IO_URING)
+    struct iovec iov[max_iovcnt];
+    int iovcnt = output_buf.peek(iov, max_iovcnt, len);
+    send_inflight = true;
+    // The connection (and output_buf) is held until the send is completed.
+    loop->uring->send(channel->fd(), iov, iovcnt, [conn = shared_from_this()](ssize_t n){
+            conn->handle_send_completion(n);
+            });
+#endif
+}
+
+void connection::handle_send_completion(ssize_t n)
+{
+    send_inflight = false;
+    if (is_closed()) return;
+    log_debug("Send (%zd) bytes by io_uring to connection(id=%zu, fd=%d)", n, conn_id, channel->fd());
+    if (n < 0) {
+        errno = -n;
+        handle_error();
+        if (is_closed()) return;
+    } else {
+        retrieve_sent(n);
+    }
+    handle_write();
+}
+
 void connection::handle_close(bool is_forced)
 {
     Assert(loop->is_io_loop_thread());
@@ -151,13 +366,22 @@ void connection::handle_close(bool is_forced)
         loop->cancel_timer(ttl_timer_id);
         ttl_timer_id = 0;
     }
-    if (!is_forced && !send_queue_is_empty()) {
+    // Wait for the kernel to finish with the memory of zerocopy sends,
+    // which are still being sent after the connection is closed.
+    if (!is_forced && (!send_queue_is_empty() || !zerocopy_pending.empty())) {
         state = Closing;
         return;
     }
     state = Closed;
     log_info("connection(id=%zu, fd=%d) is %s", conn_id, channel->fd(), get_state_str());
+    loop->get_load().connections.fetch_sub(1, std::memory_order_relaxed);
+    // The unsent data is discarded.
+    add_queued_bytes(-queued_bytes);
     channel->remove();
+#if defined (ANGEL_HAVE_IO_URING)
+    // Cancel the multishot recv and the send in flight.
+    if (loop->uring) loop->uring->release(channel->fd());
+#endif
     if (close_handler) {
         close_handler(shared_from_this());
     }
@@ -166,39 +390,101 @@ void connection::handle_close(bool is_forced)
 void connection::handle_error()
 {
     if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-        log_warn("connection(id=%zu, fd=%d): %s", conn_id, channel->fd(), util::strerrno());
+        // It is expected in edge-triggered mode.
+        if (!channel->is_edge_triggered())
+            log_warn("connection(id=%zu, fd=%d): %s", conn_id, channel->fd(), util::strerrno());
     } else {
         log_error("connection(id=%zu, fd=%d): %s", conn_id, channel->fd(), util::strerrno());
         force_close_connection();
     }
 }
 
-void connection::send_in_loop(const char *data, size_t len)
+// Write data directly if nothing is queued (unless it is sent by zerocopy).
+// Returns the number of bytes written, or -1 if the connection is closed.
+ssize_t connection::try_write(const char *data, size_t len)
 {
-    ssize_t n = 0;
-
     if (is_closed()) {
         log_warn("Unable to send, connection(id=%zu, fd=%d) is %s",
                  conn_id, channel->fd(), get_state_str());
-        return;
+        return -1;
     }
     log_debug("A new byte stream(len=%zu)", len);
-    if (!channel->is_writing() && send_queue_is_empty()) {
-        if ((n = write(data, len)) > 0) {
-            len -= n;
-        } else if (n == -2) {
-            return;
-        }
+    if (!corked && !uring_send && !channel->is_writing() && send_queue_is_empty() &&
+        !use_zerocopy(len)) {
+        ssize_t n = write(data, len);
+        if (n == -2) return -1;
+        return std::max<ssize_t>(n, 0);
     }
-    if (len > 0) {
+    return 0;
+}
+
+void connection::send_in_loop(const char *data, size_t len)
+{
+    ssize_t n = try_write(data, len);
+    if (n < 0 || n == static_cast<ssize_t>(len)) return;
+    output_buf.append(data + n, len - n);
+    queue_output(len - n);
+}
+
+void connection::send_in_loop(std::string&& data)
+{
+    if (use_zerocopy(data.size())) {
+        auto owner = std::make_shared<std::string>(std::move(data));
+        send_in_loop(owner, owner->data(), owner->size());
+        return;
+    }
+    ssize_t n = try_write(data.data(), data.size());
+    if (n < 0 || n == static_cast<ssize_t>(data.size())) return;
+    size_t len = data.size() - n;
+    if (n == 0) {
+        output_buf.append(std::move(data));
+    } else {
+        auto owner = std::make_shared<std::string>(std::move(data));
+        output_buf.append(owner, owner->data() + n, len);
+    }
+    queue_output(len);
+}
+
+void connection::send_in_loop(std::unique_ptr<char[]> data, size_t len)
+{
+    std::shared_ptr<char[]> owner(std::move(data));
+    send_in_loop(owner, owner.get(), len);
+}
+
+void connection::send_in_loop(std::shared_ptr<const void> owner, const char *data, size_t len)
+{
+    bool was_writing = channel->is_writing();
+    ssize_t n = try_write(data, len);
+    if (n < 0 || n == static_cast<ssize_t>(len)) return;
+    output_buf.append(std::move(owner), data + n, len - n);
+    queue_output(len - n);
+    // try_write() skips zerocopy data, send it now rather than in the next iteration.
+    if (use_zerocopy(len) && !was_writing && !corked) handle_write();
+}
+
+// The remaining len bytes have been appended to output_buf.
+void connection::queue_output(size_t len)
+{
+    if (!byte_stream_queue.empty() && byte_stream_queue.back().first == send_id - 1) {
+        // Nothing is queued after the last byte stream, just extend it.
+        log_debug("Remaining (%zu) bytes, merged(send_id=%zu)...", len, send_id - 1);
+        byte_stream_queue.back().second += len;
+    } else {
         log_debug("Remaining (%zu) bytes, queued(send_id=%zu)...", len, send_id);
-        output_buf.append(data + n, len);
         byte_stream_queue.emplace(send_id++, len);
-
-        channel->enable_write();
-        if (high_water_mark > 0 &&
-            output_buf.readable() >= high_water_mark &&
-            high_water_mark_handler) {
+    }
+    add_queued_bytes(len);
+
+    start_write();
+    if (high_water_mark > 0 && output_buf.readable() >= high_water_mark) {
+        above_high_water_mark = true;
+        if (backpressure && !backpressure_paused) {
+            log_debug("connection(id=%zu, fd=%d) pauses reading, (%zu) bytes queued",
+                      conn_id, channel->fd(), output_buf.readable());
+            backpressure_paused = true;
+            update_reading();
+        }
+        if (high_water_mark_handler) {
             loop->queue_in_loop([conn = shared_from_this()]{
                     conn->high_water_mark_handler(conn);
                     });
@@ -206,6 +492,63 @@ void connection::send_in_loop(const char *data, size_t len)
     }
 }
 
+void connection::check_low_water_mark()
+{
+    if (!above_high_water_mark || output_buf.readable() > low_water_mark) return;
+    above_high_water_mark = false;
+    if (backpressure_paused) {
+        log_debug("connection(id=%zu, fd=%d) resumes reading", conn_id, channel->fd());
+        backpressure_paused = false;
+        update_reading();
+    }
+    // Queued like the high water mark handler, so they are called in order.
+    if (low_water_mark_handler) {
+        loop->queue_in_loop([conn = shared_from_this()]{
+                conn->low_water_mark_handler(conn);
+                });
+    }
+}
+
+void connection::pause_read()
+{
+    loop->run_in_loop([conn = shared_from_this()]{
+            conn->read_paused = true;
+            conn->update_reading();
+            });
+}
+
+void connection::resume_read()
+{
+    loop->run_in_loop([conn = shared_from_this()]{
+            conn->read_paused = false;
+            conn->update_reading();
+            });
+}
+
+void connection::update_reading()
+{
+    if (is_closed()) return;
+    bool paused = read_paused || backpressure_paused;
+    if (paused) {
+        channel->disable_read();
+    } else if (!channel->is_reading()) {
+        channel->enable_read();
+        // The Read event may have been triggered and ignored while pausing,
+        // we will not be notified again in edge-triggered mode.
+        if (channel->is_edge_triggered()) {
+            loop->defer([conn = shared_from_this()]{
+                    if (conn->is_connected() && conn->channel->is_reading()) conn->handle_read();
+                    });
+        }
+        if (recv_held) {
+            loop->defer([conn = shared_from_this()]{
+                    if (conn->is_connected() && conn->channel->is_reading() && conn->recv_held)
+                        conn->handle_held_recv();
+                    });
+        }
+    }
+}
+
 void connection::send_file_in_loop(int fd, off_t offset, off_t count)
 {
     if (is_closed()) {
@@ -214,7 +557,7 @@ void connection::send_file_in_loop(int fd, off_t offset, off_t count)
         return;
     }
     log_debug("A new file stream(fd=%d, offset=%lld, count=%lld)", fd, offset, count);
-    if (!channel->is_writing() && send_queue_is_empty()) {
+    if (!corked && !channel->is_writing() && send_queue_is_empty()) {
         ssize_t n = sendfile(fd, offset, count);
         if (n > 0) {
             offset += n;
@@ -231,15 +574,58 @@ void connection::send_file_in_loop(int fd, off_t offset, off_t count)
         log_debug("Remaining (%lld, %lld) for file(fd=%d), queued(send_id=%zu)...",
                   offset, count, fd, send_id);
         send_file_queue.emplace(send_id++, std::move(f));
+        add_queued_bytes(count);
+        start_write();
+    }
+}
+
+void connection::start_write()
+{
+    if (!corked && !uring_send) {
         channel->enable_write();
+        return;
     }
+    // The Write event is enabled only if the socket send buffer was full,
+    // then the flush is left to handle_write().
+    if (flush_pending || channel->is_writing()) return;
+    flush_pending = true;
+    loop->defer([conn = shared_from_this()]{
+            conn->flush_corked();
+            });
+}
+
+void connection::flush_corked()
+{
+    flush_pending = false;
+    if (is_closed() || channel->is_writing()) return;
+    while (send_queued() && !is_closed()) ;
+    if (is_closed()) return;
+    check_low_water_mark();
+    update_writing();
+}
+
+void connection::set_cork(bool on)
+{
+    loop->run_in_loop([conn = shared_from_this(), on]{
+            if (conn->corked == on) return;
+            conn->corked = on;
+            // Flush what has been corked.
+            if (!on) conn->flush_corked();
+            });
 }
 
 void connection::set_send_complete_handler(const send_complete_handler_t handler)
 {
     loop->run_in_loop([conn = shared_from_this(), handler = std::move(handler)]{
             conn->send_complete_handler_queue.emplace(conn->send_id++, handler);
+            if (conn->corked || conn->uring_send) {
+                conn->start_write();
+                return;
+            }
             conn->channel->enable_write();
+            // There may be nothing to send, so no Write event will be triggered
+            // in edge-triggered mode.
+            if (conn->channel->is_edge_triggered()) conn->handle_write();
             });
 }
 
@@ -255,6 +641,18 @@ ssize_t connection::write(const char *data, size_t len)
     return n;
 }
 
+ssize_t connection::writev(const struct iovec *iov, int iovcnt)
+{
+    int fd = channel->fd();
+    ssize_t n = ::writev(fd, iov, iovcnt);
+    log_debug("Writev (%zd) bytes to connection(id=%zu, fd=%d)", n, conn_id, fd);
+    if (n < 0) {
+        handle_error();
+        return is_closed() ? -2 : -1;
+    }
+    return n;
+}
+
 ssize_t connection::sendfile(int fd, off_t offset, off_t count)
 {
     int sockfd = channel->fd();
@@ -275,8 +673,8 @@ void connection::send(const char *s, size_t len)
         send_in_loop(s, len);
     } else {
         // Delayed sending across threads must copy the data to prevent data failure.
-        loop->queue_in_loop([this, message = std::string(s, len)]{
-                this->send_in_loop(message.data(), message.size());
+        loop->queue_in_loop([this, message = std::string(s, len)]() mutable {
+                this->send_in_loop(std::move(message));
                 });
     }
     update_ttl_timer();
@@ -287,6 +685,35 @@ void connection::send(std::string_view s)
     send(s.data(), s.size());
 }
 
+void connection::send(const char *s)
+{
+    send(s, strlen(s));
+}
+
+void connection::send(std::string&& s)
+{
+    loop->run_in_loop([this, s = std::move(s)]() mutable {
+            this->send_in_loop(std::move(s));
+            });
+    update_ttl_timer();
+}
+
+void connection::send(std::unique_ptr<char[]> data, size_t len)
+{
+    loop->run_in_loop([this, data = std::move(data), len]() mutable {
+            this->send_in_loop(std::move(data), len);
+            });
+    update_ttl_timer();
+}
+
+void connection::send(std::shared_ptr<const void> owner, const char *data, size_t len)
+{
+    loop->run_in_loop([this, owner = std::move(owner), data, len]() mutable {
+            this->send_in_loop(std::move(owner), data, len);
+            });
+    update_ttl_timer();
+}
+
 void connection::send(const void *v, size_t len)
 {
     send(reinterpret_cast<const char*>(v), len);
@@ -330,8 +757,7 @@ void connection::set_ttl_timer()
 void connection::update_ttl_timer()
 {
     if (ttl_timer_id > 0) {
-        loop->cancel_timer(ttl_timer_id);
-        set_ttl_timer();
+        loop->refresh_timer(ttl_timer_id, ttl_ms);
     }
 }
 
@@ -351,6 +777,90 @@ void connection::set_high_water_mark_handler(size_t size, high_water_mark_handle
     high_water_mark_handler = std::move(handler);
 }
 
+bool connection::use_zerocopy(size_t len) const
+{
+    return zerocopy_threshold > 0 && len >= zerocopy_threshold;
+}
+
+void connection::set_zerocopy(size_t threshold)
+{
+    loop->run_in_loop([conn = shared_from_this(), threshold]{
+#if defined (ANGEL_HAVE_IO_URING)
+            // The completions are reported by POLLERR, which is not polled
+            // while the data is received by the multishot recv of io_uring.
+            if (threshold > 0 && conn->loop->uring) {
+                log_warn("connection(id=%zu, fd=%d): MSG_ZEROCOPY is not supported with io_uring",
+                         conn->conn_id, conn->channel->fd());
+                return;
+            }
+#endif
+            if (threshold > 0 && !sockops::set_zerocopy(conn->channel->fd(), true)) return;
+            conn->zerocopy_threshold = threshold;
+            });
+}
+
+// Send a slice of output_buf by MSG_ZEROCOPY,
+// and hold its owner until the kernel completes the send.
+ssize_t connection::write_zerocopy(const char *data, size_t len,
+                                   const std::shared_ptr<const void>& owner)
+{
+    int fd = channel->fd();
+    ssize_t n = sockops::send_zerocopy(fd, data, len);
+    log_debug("Send (%zd) bytes by zerocopy(seq=%u) to connection(id=%zu, fd=%d)",
+              n, zerocopy_seq, conn_id, fd);
+    if (n >= 0) {
+        zerocopy_pending.emplace_back(zerocopy_seq++, owner);
+        return n;
+    }
+    // The limit of locked pages (optmem_max) is exceeded, fall back to copying.
+    if (errno == ENOBUFS) return write(data, len);
+    handle_error();
+    return is_closed() ? -2 : -1;
+}
+
+// The completions of zerocopy sends are notified by the error queue.
+void connection::handle_error_event()
+{
+#if defined (ANGEL_HAVE_MSG_ZEROCOPY)
+    if (!zerocopy_pending.empty()) {
+        uint32_t lo, hi;
+        bool copied;
+        bool completed = false;
+        int rc;
+        while ((rc = sockops::recv_zerocopy_completion(channel->fd(), &lo, &hi, &copied)) >= 0) {
+            if (rc == 0) continue;
+            log_debug("Zerocopy sends [%u, %u] of connection(id=%zu, fd=%d) are completed%s",
+                      lo, hi, conn_id, channel->fd(), copied ? " (copied)" : "");
+            // They are almost always completed in order, but not guaranteed.
+            auto it = std::remove_if(zerocopy_pending.begin(), zerocopy_pending.end(),
+                    [lo, hi](const auto& e){ return (uint32_t)(e.first - lo) <= hi - lo; });
+            zerocopy_pending.erase(it, zerocopy_pending.end());
+            completed = true;
+        }
+        if (completed) {
+            // Run the send complete handlers waiting for them,
+            // or close the connection if it is closing.
+            if (zerocopy_pending.empty()) handle_write();
+            return;
+        }
+    }
+#endif
+    handle_error();
+}
+
+void connection::set_low_water_mark_handler(size_t size, low_water_mark_handler_t handler)
+{
+    low_water_mark = size;
+    low_water_mark_handler = std::move(handler);
+}
+
+void connection::add_queued_bytes(int64_t n)
+{
+    if (n == 0) return;
+    queued_bytes += n;
+    loop->get_load().queued_bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
 const char *connection::get_state_str()
 {
     switch (state) {
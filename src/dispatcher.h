@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 
 namespace angel {
 
@@ -20,6 +21,8 @@ public:
     // Remove events from monitered events for fd.
     // If fd has no events of interest, remove itself from dispatcher.
     virtual void remove(int fd, int events) = 0;
+    // Support registering fd with `Edge` ?
+    virtual bool has_edge_triggered() const { return false; }
 
     void set_name(const char *name) { dispatcher_name = name; }
     const char *name() { return dispatcher_name.c_str(); }
@@ -32,8 +35,8 @@ private:
 template <typename T>
 inline void resize_if(int fd, std::vector<T>& vec)
 {
-    if (fd >= vec.size())
-        vec.resize(vec.size() * 2);
+    if (static_cast<size_t>(fd) >= vec.size())
+        vec.resize(std::max(vec.size() * 2, static_cast<size_t>(fd) + 1));
 }
 
 }
@@ -29,8 +29,10 @@ epoll_base_t::~epoll_base_t()
 
 #define EEV_SET(eev, efd, filter) do { \
     (eev).data.fd = (efd); \
+    (eev).events = 0; \
     if ((filter) & Read) (eev).events |= EPOLLIN; \
     if ((filter) & Write) (eev).events |= EPOLLOUT; \
+    if ((filter) & Edge) (eev).events |= EPOLLET; \
 } while (0)
 
 
@@ -19,6 +19,7 @@ public:
     int wait(evloop *loop, int64_t timeout) override;
     void add(int fd, int events) override;
     void remove(int fd, int events) override;
+    bool has_edge_triggered() const override { return true; }
 private:
     int epfd;
     int added_fds = 0;
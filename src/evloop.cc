@@ -6,7 +6,13 @@
 #include <angel/config.h>
 
 #include "dispatcher.h"
-#include "timer.h"
+#include "buffer_pool.h"
+#include "timer_set.h"
+#include "timer_wheel.h"
+
+#if defined (ANGEL_HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
 
 #if defined (ANGEL_HAVE_KQUEUE)
 #include "kqueue.h"
@@ -20,6 +26,9 @@
 #if defined (ANGEL_HAVE_SELECT)
 #include "select.h"
 #endif
+#if defined (ANGEL_HAVE_IO_URING)
+#include "uring.h"
+#endif
 
 namespace angel {
 
@@ -30,21 +39,47 @@ namespace {
     thread_local evloop *this_thread_loop = nullptr;
 }
 
-evloop::evloop()
-    : timer(new timer_t(this)),
-    cur_tid(std::this_thread::get_id())
-{
+evloop::evloop(evloop_options ops)
+    : uring(nullptr),
+    buf_counters(buffer_pool::this_thread_counters()),
+    cur_tid(std::this_thread::get_id()),
+    wakeup_pending(false),
+    is_quit(false)
+{
+    switch (ops.timer) {
+    case evloop_options::timer_type::set:
+        timer.reset(new timer_set_t(this));
+        break;
+    case evloop_options::timer_type::wheel:
+        timer.reset(new timer_wheel_t(this));
+        break;
+    }
+    timer->set_max_timers_per_tick(ops.max_timers_per_tick);
+#if defined (ANGEL_HAVE_IO_URING)
+    if (ops.use_io_uring) {
+        auto *base = new io_uring_base_t;
+        if (base->is_supported()) {
+            dispatcher.reset(base);
+            uring = base;
+        } else {
+            delete base;
+            log_warn("io_uring is not supported, use the default I/O multiplexing");
+        }
+    }
+#endif
+    if (!dispatcher) {
 #if defined (ANGEL_HAVE_EPOLL)
-    dispatcher.reset(new epoll_base_t);
+        dispatcher.reset(new epoll_base_t);
 #elif defined (ANGEL_HAVE_KQUEUE)
-    dispatcher.reset(new kqueue_base_t);
+        dispatcher.reset(new kqueue_base_t);
 #elif defined (ANGEL_HAVE_POLL)
-    dispatcher.reset(new poll_base_t);
+        dispatcher.reset(new poll_base_t);
 #elif defined (ANGEL_HAVE_SELECT)
-    dispatcher.reset(new select_base_t);
+        dispatcher.reset(new select_base_t);
 #else
-    log_fatal("No supported I/O multiplexing");
+        log_fatal("No supported I/O multiplexing");
 #endif
+    }
     if (this_thread_loop) {
         log_fatal("Only have one evloop in this thread");
     } else {
@@ -62,7 +97,6 @@ evloop::~evloop()
 
 void evloop::run()
 {
-    is_quit = false;
     while (!is_quit) {
         int64_t timeout = timer->timeout();
         int nevents = dispatcher->wait(this, timeout);
@@ -71,41 +105,53 @@ void evloop::run()
                 channel->handle_event();
             }
             active_channels.clear();
-        } else if (nevents == 0) {
-            timer->tick();
         }
+        // If the poller always returns events before the earliest timer expires,
+        // the timers will never be executed if we only tick when nevents == 0.
+        timer->tick();
         do_functors();
+        do_deferred_functors();
     }
 
     // Ensure that all tasks are executed when exiting.
-    while (true) {
-        {
-            std::lock_guard<std::mutex> lk(mtx);
-            if (functors.empty()) break;
-        }
+    while (!functors.empty() || !deferred_functors.empty()) {
         do_functors();
+        do_deferred_functors();
     }
+    // Allow to run() again.
+    is_quit = false;
 }
 
 void evloop::do_functors()
 {
-    std::vector<functor> tfuncs;
-    {
-        std::lock_guard<std::mutex> lk(mtx);
-        if (!functors.empty()) {
-            // It can't be executed here, otherwise deadlock may occur.
-            // (such as queue_in_loop() will require mtx, then causes deadlock)
-            tfuncs.swap(functors);
-        }
-    }
-    if (!tfuncs.empty()) {
-        for (auto& f : tfuncs) f();
-    }
+    // Must be cleared before taking tasks out,
+    // otherwise a task queued after run() may not wakeup us.
+    wakeup_pending.store(false);
+    functors.run();
+}
+
+void evloop::do_deferred_functors()
+{
+    if (deferred_functors.empty()) return;
+    // The tasks may defer() new tasks, which run in the next iteration.
+    std::vector<functor> tasks;
+    tasks.swap(deferred_functors);
+    for (auto& task : tasks) task();
 }
 
 void evloop::wakeup_init()
 {
+#if defined (ANGEL_HAVE_EVENTFD)
+    // eventfd is cheaper than socketpair, and multiple writes
+    // are coalesced into its counter, so it will never block the waker.
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) log_fatal("eventfd: %s", strerrno());
+    wake_pair[0] = wake_pair[1] = fd;
+#else
     sockops::socketpair(wake_pair);
+    sockops::set_nonblock(wake_pair[0]);
+    sockops::set_nonblock(wake_pair[1]);
+#endif
     wake_channel = new channel(this, wake_pair[0]);
     wake_channel->set_read_handler([this]{ this->wakeup_read(); });
     wake_channel->add();
@@ -114,70 +160,51 @@ void evloop::wakeup_init()
 void evloop::wakeup_close()
 {
     wake_channel->remove();
+#if !defined (ANGEL_HAVE_EVENTFD)
     close(wake_pair[1]);
+#endif
 }
 
 // Wakeup current io loop thread
-void evloop::wakeup(uint8_t v)
+void evloop::wakeup()
 {
     // Multi-thread concurrently write is safe here.
-    // We have no writing order requirement, just write one byte into the pair.
+#if defined (ANGEL_HAVE_EVENTFD)
+    uint64_t v = 1;
+#else
+    uint8_t v = 0;
+#endif
     ssize_t n = write(wake_pair[1], &v, sizeof(v));
-    if (n != sizeof(v)) {
+    // EAGAIN means there are already enough pending wakeups.
+    if (n != sizeof(v) && errno != EAGAIN) {
         log_error("write(): %s", strerrno());
     }
 }
 
 void evloop::wakeup_read()
 {
-    uint8_t v;
+    // Consume all pending wakeups.
+#if defined (ANGEL_HAVE_EVENTFD)
+    uint64_t v;
     ssize_t n = read(wake_pair[0], &v, sizeof(v));
-    if (n > 0) {
-        if (v) is_quit = true;
-    } else {
+#else
+    char buf[64];
+    ssize_t n = read(wake_pair[0], buf, sizeof(buf));
+#endif
+    if (n < 0 && errno != EAGAIN) {
         log_error("read(): %s", strerrno());
     }
 }
 
-channel *evloop::search_channel(int fd)
-{
-    return channel_map[fd].get();
-}
-
 bool evloop::is_io_loop_thread()
 {
     return std::this_thread::get_id() == cur_tid;
 }
 
-void evloop::run_in_loop(functor cb)
-{
-    if (!is_io_loop_thread()) {
-        queue_in_loop(std::move(cb));
-    } else {
-        cb();
-    }
-}
-
-void evloop::queue_in_loop(functor cb)
-{
-    std::lock_guard<std::mutex> lk(mtx);
-    functors.emplace_back(std::move(cb));
-    // We don't have to wakeup() every time,
-    // just wakeup() when the first task is queued.
-    //
-    // WARNING: If you wakeup() every time, but evloop don't wakeup_read() in time,
-    // the wake_pair buffer may be filled, and when you wakeup() again,
-    // the wakeup thread will be blocked.
-    if (functors.size() == 1) {
-        wakeup(0);
-    }
-}
-
 size_t evloop::run_after(int64_t timeout, timer_callback_t cb)
 {
     auto expire = util::get_cur_time_ms() + timeout;
-    auto *task  = new timer_task_t(expire, 0, std::move(cb));
-    size_t id   = timer->add_timer(task);
+    size_t id   = timer->add_timer(expire, 0, std::move(cb));
     log_debug("Add a timer(id=%zu) after %lld ms", id, timeout);
     return id;
 }
@@ -185,8 +212,7 @@ size_t evloop::run_after(int64_t timeout, timer_callback_t cb)
 size_t evloop::run_every(int64_t interval, timer_callback_t cb)
 {
     auto expire = util::get_cur_time_ms() + interval;
-    auto *task  = new timer_task_t(expire, interval, std::move(cb));
-    size_t id   = timer->add_timer(task);
+    size_t id   = timer->add_timer(expire, interval, std::move(cb));
     log_debug("Add a timer(id=%zu) every %lld ms", id, interval);
     return id;
 }
@@ -196,9 +222,28 @@ void evloop::cancel_timer(size_t id)
     timer->cancel_timer(id);
 }
 
+void evloop::refresh_timer(size_t id, int64_t timeout)
+{
+    timer->refresh_timer(id, timeout);
+}
+
+timer_stats evloop::get_timer_stats() const
+{
+    return timer->get_stats();
+}
+
+buffer_stats evloop::get_buffer_stats() const
+{
+    buffer_stats stats;
+    stats.in_use_bytes = buf_counters->in_use.load(std::memory_order_relaxed);
+    stats.cached_bytes = buf_counters->cached.load(std::memory_order_relaxed);
+    return stats;
+}
+
 void evloop::quit()
 {
-    wakeup(1);
+    is_quit = true;
+    wakeup();
 }
 
 }
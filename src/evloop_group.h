@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <memory>
+#include <random>
 
 #include <angel/evloop_thread.h>
 #include <angel/util.h>
@@ -13,11 +14,13 @@ class evloop_group {
 public:
     evloop_group(
             size_t nums = std::thread::hardware_concurrency(),
-            bool is_set_cpu_affinity = false)
-        : next_index(0)
+            bool is_set_cpu_affinity = false,
+            evloop_options ops = evloop_options(),
+            placement_policy policy = placement_policy::round_robin)
+        : policy(policy), next_index(0)
     {
         for (size_t i = 0; i < nums; i++) {
-            group.emplace_back(new evloop_thread);
+            group.emplace_back(new evloop_thread(ops));
         }
         if (is_set_cpu_affinity) {
             int cpu_number = 0;
@@ -35,13 +38,68 @@ public:
     evloop_group& operator=(const evloop_group&) = delete;
 
     size_t size() const { return group.size(); }
-    // Select an io loop by using [round-robin]
+    evloop *get_loop(size_t i) { return group[i]->get_loop(); }
+    // Select an io loop for a new connection by the placement policy.
     evloop *get_next_loop()
+    {
+        switch (policy) {
+        case placement_policy::least_connections:
+            return select_min(connections_of);
+        case placement_policy::least_queued_bytes:
+            return select_min(queued_bytes_of);
+        case placement_policy::power_of_two_choices:
+            return select_two();
+        default:
+            return select_next();
+        }
+    }
+private:
+    static int64_t connections_of(evloop *loop)
+    {
+        return loop->get_load().connections.load(std::memory_order_relaxed);
+    }
+    static int64_t queued_bytes_of(evloop *loop)
+    {
+        return loop->get_load().queued_bytes.load(std::memory_order_relaxed);
+    }
+
+    evloop *select_next()
     {
         if (next_index >= group.size()) next_index = 0;
         return group[next_index++]->get_loop();
     }
-private:
+    // Start from a random one, so that ties (e.g. all loops are idle)
+    // are broken evenly, even if the workload is periodic.
+    evloop *select_min(int64_t (*load_of)(evloop*))
+    {
+        size_t n = group.size();
+        size_t start = rng() % n;
+        evloop *min_loop = group[start]->get_loop();
+        int64_t min_load = load_of(min_loop);
+        for (size_t i = 1; i < n; i++) {
+            evloop *loop = group[(start + i) % n]->get_loop();
+            int64_t load = load_of(loop);
+            if (load < min_load) {
+                min_loop = loop;
+                min_load = load;
+            }
+        }
+        return min_loop;
+    }
+    evloop *select_two()
+    {
+        size_t n = group.size();
+        if (n < 2) return select_next();
+        size_t i = rng() % n;
+        size_t j = rng() % (n - 1);
+        if (j >= i) j++;
+        evloop *a = group[i]->get_loop();
+        evloop *b = group[j]->get_loop();
+        return connections_of(a) <= connections_of(b) ? a : b;
+    }
+
+    placement_policy policy;
+    std::minstd_rand rng;
     size_t next_index;
     std::vector<std::unique_ptr<evloop_thread>> group;
 };
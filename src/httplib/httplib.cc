@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include <angel/mime.h>
 #include <angel/config.h>
@@ -55,8 +56,9 @@ StatusCode message::parse_header(buffer& buf)
             return Ok;
         }
 
-        int pos = buf.find(":");
-        if (pos < 0) return BadRequest;
+        auto *sep = (const char *)memchr(buf.peek(), ':', crlf);
+        if (!sep) return BadRequest;
+        int pos = sep - buf.peek();
 
         std::string_view field(buf.peek(), pos);
         std::string_view value(util::trim({buf.peek() + pos + 1, (size_t)(crlf - pos - 1)}));
@@ -333,60 +335,232 @@ static const std::unordered_map<std::string_view, Method> methods = {
     { "DELETE",     DELETE },
     { "TRACE",      TRACE },
     { "CONNECT",    CONNECT },
+    { "PATCH",      PATCH },
 };
 
 static const int UriMaxLength = 1024 * 1024;
 
-// Request-Line = Method <SP> Request-URI <SP> HTTP-Version <CRLF>
-StatusCode request::parse_line(buffer& buf)
-{
-    int crlf = buf.find_crlf();
-    if (crlf < 0) return Continue;
-
-    if (crlf > UriMaxLength) {
-        return RequestUriTooLong;
+// ?k1=v1&k2=v2&k3=v3
+// Check the query params without decoding them (see uri::parse_params()).
+static bool check_params(std::string_view query)
+{
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        auto arg = query.substr(0, amp);
+        if (arg.find('=') == std::string_view::npos) return false;
+        for (size_t i = 0; i < arg.size(); i++) {
+            if (arg[i] != '%') continue;
+            if (i + 2 >= arg.size() || !ishexnumber(arg[i + 1]) || !ishexnumber(arg[i + 2]))
+                return false;
+        }
+        if (amp == std::string_view::npos) break;
+        query.remove_prefix(amp + 1);
     }
+    return true;
+}
 
-    auto res = util::split({buf.peek(), (size_t)crlf}, SP);
-    if (res.size() != 3) return BadRequest;
+// Request-Line = Method <SP> Request-URI <SP> HTTP-Version <CRLF>
+StatusCode request::parse_line(std::string_view line)
+{
+    size_t sp1 = line.find(SP);
+    if (sp1 == std::string_view::npos) return BadRequest;
+    size_t sp2 = line.find(SP, sp1 + 1);
+    if (sp2 == std::string_view::npos || line.find(SP, sp2 + 1) != std::string_view::npos)
+        return BadRequest;
 
     // Parse Method
-    auto it = methods.find(res[0]);
+    auto it = methods.find(line.substr(0, sp1));
     if (it == methods.end()) return BadRequest;
     req_method = it->second;
 
     // Parse Request-URI
-    const char *p = res[1].data();
-    const char *end = p + res[1].size();
-
-    const char *sep = std::find(p, end, '?');
-    if (!uri::decode({p, (size_t)(sep - p)}, abs_path)) return BadRequest;
+    auto request_uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t sep = request_uri.find('?');
+    if (!uri::decode(request_uri.substr(0, sep), abs_path)) return BadRequest;
 
-    if (sep != end) { // have parameters
-        end = std::find(p, end, '#'); // ignore #fragment
-        if (!uri::parse_params(sep + 1, end, query_params)) return BadRequest;
+    if (sep != std::string_view::npos) { // have parameters
+        auto query = request_uri.substr(sep + 1);
+        query_str = query.substr(0, query.find('#')); // ignore #fragment
+        if (!check_params(query_str)) return BadRequest;
     }
 
     // Parse HTTP-Version
-    if (res[2] == "HTTP/1.1") {
+    auto version = line.substr(sp2 + 1);
+    if (version == "HTTP/1.1") {
         http_version = HTTP_VERSION_1_1;
-    } else if (res[2] == "HTTP/1.0") {
+    } else if (version == "HTTP/1.0") {
         http_version = HTTP_VERSION_1_0;
-    } else if (res[2] == "HTTP/2.0") {
+    } else if (version == "HTTP/2.0") {
         return HttpVersionNotSupported;
     } else {
         return BadRequest;
     }
+    return Ok;
+}
 
-    buf.retrieve(crlf + 2);
+// message-header = field-name ":" [ field-value ] <CRLF>
+StatusCode request::parse_fields(std::string_view fields)
+{
+    const char *p = fields.data();
+    const char *end = p + fields.size();
+    while (p < end) {
+        const char *crlf = util::find_crlf(p, end);
+        std::string_view line(p, crlf - p);
+        size_t pos = line.find(':');
+        if (pos == std::string_view::npos) return BadRequest;
+        auto value = util::trim(line.substr(pos + 1));
+        // Ignore header with null value.
+        if (!value.empty()) {
+            header_views.push_back({ line.substr(0, pos), value });
+        }
+        p = crlf + 2;
+    }
     return Ok;
 }
 
+// The head may arrive in many small reads, so the scan resumes
+// from where the last call stopped instead of from buf.peek().
+StatusCode request::parse_head(buffer& buf)
+{
+    const char *first = buf.peek();
+    const char *last = buf.end();
+    size_t size = buf.readable();
+    while (true) {
+        const char *crlf = util::find_crlf(first + scan_pos, last);
+        if (crlf == last) {
+            if (line_pos == 0 && size > UriMaxLength) {
+                return RequestUriTooLong;
+            }
+            // The last byte may be the CR of a CRLF.
+            scan_pos = std::max(line_pos, size > 0 ? size - 1 : 0);
+            return Continue;
+        }
+        size_t pos = crlf - first;
+        if (line_pos == 0) { // Request-Line
+            if (pos > UriMaxLength) return RequestUriTooLong;
+            line_len = pos;
+        } else if (pos == line_pos) { // The empty line
+            head_len = pos + 2;
+            break;
+        }
+        line_pos = scan_pos = pos + 2;
+    }
+
+    auto code = parse_line({first, line_len});
+    if (code != Ok) return code;
+    size_t fields = line_len + 2;
+    return parse_fields({first + fields, head_len - 2 - fields});
+}
+
+// See message::parse_body_length()
+StatusCode request::parse_body_length()
+{
+    if (header("Transfer-Encoding") == "chunked") {
+        chunked = true;
+        return Ok;
+    }
+
+    auto content_length = header("Content-Length");
+    if (content_length.empty()) return Continue;
+
+    auto r = util::svtoll(content_length);
+    if (r.value_or(-1) < 0) return BadRequest;
+
+    length = r.value();
+    return length > 0 ? Ok : Continue;
+}
+
+// Copy the head out of buf and retrieve it,
+// so that buf can be compacted (e.g. when reading the body).
+void request::own_head(buffer& buf)
+{
+    const char *base = buf.peek();
+    head.assign(base, head_len);
+    auto rebase = [this, base](std::string_view& s) {
+        if (!s.empty()) s = { head.data() + (s.data() - base), s.size() };
+    };
+    rebase(query_str);
+    for (auto& [field, value] : header_views) {
+        rebase(field);
+        rebase(value);
+    }
+    buf.retrieve(head_len);
+    head_len = 0;
+}
+
+const Params& request::params() const
+{
+    if (!params_parsed) {
+        params_parsed = true;
+        if (!query_str.empty()) {
+            uri::parse_params(query_str.data(), query_str.data() + query_str.size(), query_params);
+        }
+    }
+    return query_params;
+}
+
+const Headers& request::headers() const
+{
+    if (!header_map_built) {
+        header_map_built = true;
+        for (auto& [field, value] : header_views) {
+            header_map.emplace(field, value);
+        }
+        // The trailer of a chunked body
+        for (auto& [field, value] : message::headers) {
+            header_map.emplace(field, value);
+        }
+    }
+    return header_map;
+}
+
+std::string_view request::header(std::string_view field) const
+{
+    for (auto& h : header_views) {
+        if (util::equal_case(h.field, field)) return h.value;
+    }
+    if (!message::headers.empty()) {
+        auto it = message::headers.find(field);
+        if (it != message::headers.end()) return it->second;
+    }
+    return {};
+}
+
+std::string_view request::path_param(std::string_view name) const
+{
+    for (auto& param : route_params) {
+        if (param.name == name) return param.value;
+    }
+    return {};
+}
+
+void request::remove_header(std::string_view field)
+{
+    header_views.erase(std::remove_if(header_views.begin(), header_views.end(),
+                [field](const header_view& h){ return util::equal_case(h.field, field); }),
+            header_views.end());
+    header_map.erase(field);
+    message::headers.erase(field);
+}
+
 void request::clear()
 {
     state = ParseLine;
     abs_path.clear();
-    query_params.clear();
+    query_str = {};
+    header_views.clear();
+    route_params.clear();
+    line_len = line_pos = scan_pos = 0;
+    head_len = 0;
+    head.clear();
+    if (params_parsed) {
+        query_params.clear();
+        params_parsed = false;
+    }
+    if (header_map_built) {
+        header_map.clear();
+        header_map_built = false;
+    }
     message::clear();
 }
 
@@ -446,11 +620,12 @@ void response::send(std::string_view body)
     if (body.size() > 0)
         add_header("Content-Length", std::to_string(body.size()));
     if (body.size() >= BufferedSize) {
-        conn->send(header());
-        conn->send(body);
+        write(header());
+        write(body);
     } else {
-        conn->send(header().append(body));
+        write(header().append(body));
     }
+    flush(true);
 }
 
 void response::send_chunk(std::string_view chunk)
@@ -459,7 +634,7 @@ void response::send_chunk(std::string_view chunk)
         chunked = true;
         add_header("Transfer-Encoding", "chunked");
         if (chunk.size() >= BufferedSize) {
-            conn->send(header());
+            write(header());
         } else {
             chunked_buf.append(header());
         }
@@ -467,25 +642,96 @@ void response::send_chunk(std::string_view chunk)
     char x[16];
     snprintf(x, sizeof(x), "%zx\r\n", chunk.size());
     if (chunk.size() >= BufferedSize) {
-        conn->send(chunked_buf.append(x));
-        conn->send(chunk);
+        write(chunked_buf.append(x));
+        write(chunk);
         chunked_buf.clear();
         chunked_buf.append(CRLF);
     } else {
         chunked_buf.append(x).append(chunk).append(CRLF);
         if (chunked_buf.size() >= BufferedSize) {
-            conn->send(chunked_buf);
+            write(chunked_buf);
             chunked_buf.clear();
         }
     }
+    flush(false);
 }
 
 void response::send_done()
 {
     chunked = false;
     chunked_buf.append("0\r\n\r\n");
-    conn->send(chunked_buf);
+    write(chunked_buf);
     chunked_buf.clear();
+    flush(true);
+}
+
+void response::write(std::string_view data)
+{
+    if (async_output) {
+        out.append(data);
+    } else if (held) {
+        hold(data);
+    } else {
+        conn->send(data);
+    }
+}
+
+// Only in the io loop, like the following ones.
+void response::write_file(int fd, off_t offset, off_t count)
+{
+    if (held) {
+        held_parts.push_back({ {}, fd, offset, count, false });
+    } else {
+        conn->send_file(fd, offset, count);
+    }
+}
+
+void response::close_file(int fd)
+{
+    if (held) {
+        held_parts.push_back({ {}, fd, 0, 0, true });
+    } else {
+        conn->set_send_complete_handler([fd](const connection_ptr& conn){ close(fd); });
+    }
+}
+
+void response::hold(std::string_view data)
+{
+    if (held_parts.empty() || held_parts.back().fd >= 0) {
+        held_parts.emplace_back();
+    }
+    held_parts.back().data.append(data);
+}
+
+// All responses ahead of it have been sent.
+void response::release()
+{
+    held = false;
+    for (auto& part : held_parts) {
+        if (part.fd < 0) {
+            conn->send(std::move(part.data));
+        } else if (part.close_fd) {
+            close_file(part.fd);
+        } else {
+            conn->send_file(part.fd, part.offset, part.count);
+        }
+    }
+    held_parts.clear();
+}
+
+void response::flush(bool done)
+{
+    if (!async_output) return;
+    if (done) {
+        // The response may be reused by the next request
+        // as soon as it is handed over, don't touch it after that.
+        auto output = std::move(async_output);
+        async_output = nullptr;
+        output(std::move(out), true);
+    } else if (!out.empty()) {
+        async_output(std::move(out), false);
+        out.clear();
+    }
 }
 
 void response::send_err()
@@ -499,47 +745,74 @@ void http_server::message_handler(const connection_ptr& conn, buffer& buf)
     StatusCode code;
     if (!conn->is_connected()) return;
     auto& ctx = std::any_cast<context&>(conn->get_context());
-    auto& req = ctx.request;
-    auto& res = ctx.response;
+    ctx.input = &buf;
+    exchange *ex = nullptr;
+    // Cork the connection if more than one response may be sent in this
+    // call, so that they are flushed together at the end.
+    bool batch = false;
+    auto start_batch = [&]{
+        if (batch || cork) return;
+        conn->set_cork(true);
+        batch = true;
+    };
+    if (ctx.pipeline.size() > 1) start_batch();
+    // The head of the request is retrieved from buf after it is processed,
+    // since the request points into buf.
+    auto complete = [&](size_t body_len) {
+        auto& req = ex->request;
+        if (buf.readable() > req.head_size() + body_len) start_batch();
+        process_request(*ex);
+        if (ex->async_handler) {
+            // The request must not point into buf any more.
+            if (req.head_size() > 0) req.own_head(buf);
+            buf.retrieve(body_len);
+            run_async(conn, *ex);
+            return;
+        }
+        buf.retrieve(req.head_size() + body_len);
+        req.clear();
+        ex->done = true;
+    };
     // printf("%s\n", buf.c_str());
-    while (buf.readable() > 0) {
+    while (buf.readable() > 0 && (ex = next_exchange(conn, ctx))) {
+        auto& req = ex->request;
+        auto& res = ex->response;
         switch (req.state) {
         case ParseLine:
-            switch (code = req.parse_line(buf)) {
-            case Ok:
-                req.state = ParseHeader;
-                break;
-            case Continue:
-                return;
-            default:
-                goto err;
-            }
-            break;
         case ParseHeader:
-            switch (code = req.parse_header(buf)) {
+            switch (code = req.parse_head(buf)) {
             case Ok:
-                if (!req.headers().count("Host")) {
+                if (req.header("Host").empty()) {
                     code = BadRequest;
                     goto err;
                 }
                 if (expect(req, res) == Failed) {
+                    buf.retrieve(req.head_size());
                     req.clear();
-                    return;
+                    ex->done = true;
+                    goto end;
                 }
 
                 switch (code = req.parse_body_length()) {
                 case Ok:
+                    // The whole body has been received, take it from buf directly.
+                    if (!req.chunked && buf.readable() >= req.head_size() + req.length) {
+                        req.message::body.assign(buf.peek() + req.head_size(), req.length);
+                        complete(req.length);
+                        break;
+                    }
+                    req.own_head(buf);
                     req.state = ParseBody;
                     break;
                 case Continue:
-                    process_request(conn, req, res);
+                    complete(0);
                     break;
                 default:
                     goto err;
                 }
                 break;
             case Continue:
-                return;
+                goto end;
             default:
                 goto err;
             }
@@ -547,75 +820,219 @@ void http_server::message_handler(const connection_ptr& conn, buffer& buf)
         case ParseBody:
             switch (code = req.parse_body(buf)) {
             case Ok:
-                process_request(conn, req, res);
+                complete(0);
                 break;
             case Continue:
-                return;
+                goto end;
             default:
                 goto err;
             }
             break;
         }
     }
+end:
+    send_completed(conn, ctx);
+    if (batch) conn->set_cork(false);
     return;
 err:
-    ctx.response.set_status_code(code);
-    ctx.response.add_header("Connection", "close");
-    ctx.response.send_err();
-    conn->close();
+    // It is sent after the responses ahead of it, then the connection is closed.
+    ex->response.set_status_code(code);
+    ex->response.add_header("Connection", "close");
+    ex->response.keepalive = false;
+    ex->response.send_err();
+    ex->request.clear();
+    ex->done = true;
+    goto end;
+}
+
+// Return the exchange for the request at the front of buf,
+// or nullptr if no more requests can be processed for now.
+exchange *http_server::next_exchange(const connection_ptr& conn, context& ctx)
+{
+    auto& pipeline = ctx.pipeline;
+    send_completed(conn, ctx);
+    if (!conn->is_connected()) return nullptr;
+    if (!pipeline.empty()) {
+        auto& last = pipeline.back();
+        // It is still being parsed.
+        if (!last.done && !last.async_handler) return &last;
+        // The connection will be closed after it.
+        if (!last.response.keepalive) return nullptr;
+    }
+    if (pipeline.size() >= pipeline_depth) {
+        // Stop reading until the earlier responses are sent.
+        if (!ctx.read_paused) {
+            conn->pause_read();
+            ctx.read_paused = true;
+        }
+        return nullptr;
+    }
+    if (ctx.read_paused) {
+        conn->resume_read();
+        ctx.read_paused = false;
+    }
+    if (ctx.spare.empty()) {
+        ctx.spare.emplace_back();
+        ctx.spare.back().response.conn = conn.get();
+    }
+    pipeline.splice(pipeline.end(), ctx.spare, ctx.spare.begin());
+    auto& ex = pipeline.back();
+    ex.id = ctx.next_id++;
+    ex.done = false;
+    ex.response.keepalive = true;
+    ex.response.held = pipeline.size() > 1;
+    return &ex;
+}
+
+// Send the completed responses at the front of the pipeline in order,
+// and the held output of the first one which has not been completed.
+void http_server::send_completed(const connection_ptr& conn, context& ctx)
+{
+    auto& pipeline = ctx.pipeline;
+    while (!pipeline.empty()) {
+        auto& ex = pipeline.front();
+        if (ex.response.held) ex.response.release();
+        if (!ex.done) break;
+        bool keepalive = ex.response.keepalive;
+        ctx.spare.splice(ctx.spare.end(), pipeline, pipeline.begin());
+        if (!keepalive) {
+            conn->close();
+            break;
+        }
+    }
 }
 
-void http_server::process_request(const connection_ptr& conn, request& req, response& res)
+void http_server::process_request(exchange& ex)
 {
-    bool is_keepalive = keepalive(req);
-    res.add_header("Connection", is_keepalive ? "keep-alive" : "close");
+    auto& req = ex.request;
+    auto& res = ex.response;
+    // The connection is closed after the response is sent (see send_completed()).
+    res.keepalive = keepalive(req);
+    res.add_header("Connection", res.keepalive ? "keep-alive" : "close");
 
     switch (req.method()) {
     case GET:
-        if (handle_user_router(req, res)) break;
+        if (handle_user_router(ex)) break;
         handle_static_file_request(req, res);
         break;
     case HEAD:
         handle_static_file_request(req, res);
         break;
-    case POST:
-        handle_user_router(req, res);
-        break;
     case PUT:
-        handle_static_file_request(req, res);
-        break;
     case DELETE:
+        if (handle_user_router(ex)) break;
         handle_static_file_request(req, res);
         break;
+    case POST:
+    case PATCH:
+        if (handle_user_router(ex)) break;
+        res.set_status_code(NotFound);
+        res.send_err();
+        break;
     default:
         res.set_status_code(NotImplemented);
         res.send_err();
         break;
     }
+}
 
-    req.clear();
+// Run the user handler in the task thread pool, the response is sent
+// in the io loop as it is completed.
+void http_server::run_async(const connection_ptr& conn, exchange& ex)
+{
+    // async_output is stored in the exchange owned by the connection,
+    // so it refers to the connection weakly, and finds the exchange by
+    // its id, which may have been discarded or reused by then.
+    // The server is reached by the context of conn, rather than captured,
+    // so that the task fits in the inline storage of task_queue.
+    ex.response.async_output = [wconn = std::weak_ptr<connection>(conn), id = ex.id]
+        (std::string&& data, bool done) {
+        auto conn = wconn.lock();
+        if (!conn) return;
+        conn->get_loop()->run_in_loop([wconn, id, data = std::move(data), done]() mutable {
+                auto conn = wconn.lock();
+                if (!conn || !conn->is_connected()) return;
+                auto& ctx = std::any_cast<context&>(conn->get_context());
+                exchange *found = nullptr;
+                for (auto& ex : ctx.pipeline) {
+                    if (ex.id == id) {
+                        found = &ex;
+                        break;
+                    }
+                }
+                if (!found) return;
+                auto& ex = *found;
+                if (ex.response.held) {
+                    ex.response.hold(data);
+                } else if (!data.empty()) {
+                    conn->send(std::move(data));
+                }
+                if (done) ctx.server->finish_async(conn, ex);
+                });
+    };
+    ex.handler_running = true;
+    // The connection is alive while the handler is running,
+    // the exchange may have been completed and reused after it returns.
+    server.executor([conn, &ex, id = ex.id]{
+            (*ex.async_handler)(ex.request, ex.response);
+            conn->get_loop()->run_in_loop([conn, &ex, id]{
+                    if (ex.id != id) return;
+                    ex.handler_running = false;
+                    if (!conn->is_connected()) ex.response.async_output = nullptr;
+                    });
+            });
+}
 
-    if (!is_keepalive) {
-        conn->close();
+void http_server::finish_async(const connection_ptr& conn, exchange& ex)
+{
+    auto& ctx = std::any_cast<context&>(conn->get_context());
+    ex.async_handler = nullptr;
+    ex.request.clear();
+    ex.response.out.clear();
+    ex.done = true;
+    // Send it and the ones completed after it,
+    // and go on with the requests left in the input buffer.
+    message_handler(conn, *ctx.input);
+}
+
+// Drop async_output of the responses not completed by the handlers
+// which have returned, the others are dropped as the handlers return
+// (see run_async()).
+void http_server::handle_close(const connection_ptr& conn)
+{
+    auto *ctx = std::any_cast<context>(&conn->get_context());
+    if (!ctx) return;
+    for (auto& ex : ctx->pipeline) {
+        if (ex.async_handler && !ex.handler_running) {
+            ex.response.async_output = nullptr;
+        }
     }
 }
 
 bool http_server::keepalive(request& req)
 {
-    auto it = req.headers().find("Connection");
-    if (it == req.headers().end()) {
+    auto connection = req.header("Connection");
+    if (connection.empty()) {
         // HTTP/1.1 Keep-Alive by default
         return req.version() == HTTP_VERSION_1_1;
     }
-    return util::equal_case(it->second, "keep-alive");
+    return util::equal_case(connection, "keep-alive");
 }
 
-bool http_server::handle_user_router(request& req, response& res)
+bool http_server::handle_user_router(exchange& ex)
 {
-    auto& table = router.at(req.method());
-    auto it = table.find(req.path());
-    if (it == table.end()) return false;
-    it->second(req, res);
+    auto& req = ex.request;
+    auto it = routers.find(req.method());
+    if (it == routers.end()) return false;
+    auto *handler = it->second.find(req.path(), req.route_params);
+    if (!handler) return false;
+    if (async_handlers) {
+        // It is run after the request is taken from the input buffer
+        // (see message_handler()).
+        ex.async_handler = handler;
+        return true;
+    }
+    (*handler)(req, ex.response);
     return true;
 }
 
@@ -674,7 +1091,7 @@ void http_server::handle_static_file_request(request& req, response& res)
 
     if (req.method() == GET) {
         handle_file_router(req, res);
-        if (req.headers().count("Range")) {
+        if (!req.header("Range").empty()) {
             handle_range_request(req, res);
         } else {
             send_file(req, res);
@@ -730,12 +1147,12 @@ ConditionCode http_server::handle_conditional(request& req, response& res)
 // modification of the wrong version of a resource.
 ConditionCode http_server::if_match(request& req, response& res)
 {
-    auto it = req.headers().find("If-Match");
-    if (it == req.headers().end()) return NoHeader;
+    auto value = req.header("If-Match");
+    if (value.empty()) return NoHeader;
 
-    if (it->second == "*") return Successful;
+    if (value == "*") return Successful;
 
-    auto etags = util::split(it->second, ',');
+    auto etags = util::split(value, ',');
     for (auto& etag : etags) {
         if (strong_etag_equal(etag, req.etag)) {
             return Successful;
@@ -755,10 +1172,10 @@ ConditionCode http_server::if_match(request& req, response& res)
 // returned without any message-body.
 ConditionCode http_server::if_modified_since(request& req, response& res)
 {
-    auto it = req.headers().find("If-Modified-Since");
-    if (it == req.headers().end()) return NoHeader;
+    auto value = req.header("If-Modified-Since");
+    if (value.empty()) return NoHeader;
 
-    if (it->second != req.last_modified) {
+    if (value != req.last_modified) {
         return Successful;
     }
     res.set_status_code(NotModified);
@@ -773,14 +1190,14 @@ ConditionCode http_server::if_modified_since(request& req, response& res)
 // the resource does not exist.
 ConditionCode http_server::if_none_match(request& req, response& res)
 {
-    auto it = req.headers().find("If-None-Match");
-    if (it == req.headers().end()) return NoHeader;
+    auto value = req.header("If-None-Match");
+    if (value.empty()) return NoHeader;
 
-    auto etags = util::split(it->second, ',');
+    auto etags = util::split(value, ',');
 
     auto *etag_equal = (req.method() == GET || req.method() == HEAD) ? weak_etag_equal : strong_etag_equal;
 
-    if (it->second == "*") goto end;
+    if (value == "*") goto end;
 
     for (auto& etag : etags) {
         if (etag_equal(etag, req.etag)) {
@@ -824,24 +1241,24 @@ end:
 // entire new entity`.
 ConditionCode http_server::if_range(request& req, response& res)
 {
-    auto it = req.headers().find("If-Range");
-    if (it == req.headers().end()) return NoHeader;
+    auto value = req.header("If-Range");
+    if (value.empty()) return NoHeader;
 
     // The If-Range header SHOULD only be used together with a Range header,
     // and MUST be ignored if the request does not include a Range header.
-    if (!req.headers().count("Range")) return Successful;
+    if (req.header("Range").empty()) return Successful;
 
-    if (is_etag(it->second)) {
-        if (strong_etag_equal(it->second, req.etag)) {
+    if (is_etag(value)) {
+        if (strong_etag_equal(value, req.etag)) {
             return Successful;
         }
     } else {
-        if (it->second == req.last_modified) {
+        if (value == req.last_modified) {
             return Successful;
         }
     }
     // Perform it as if the Range header were not present.
-    req.message::headers.erase("Range");
+    req.remove_header("Range");
     return Successful;
 }
 
@@ -852,10 +1269,10 @@ ConditionCode http_server::if_range(request& req, response& res)
 // a 412 (Precondition Failed).
 ConditionCode http_server::if_unmodified_since(request& req, response& res)
 {
-    auto it = req.headers().find("If-Unmodified-Since");
-    if (it == req.headers().end()) return NoHeader;
+    auto value = req.header("If-Unmodified-Since");
+    if (value.empty()) return NoHeader;
 
-    if (it->second == req.last_modified) {
+    if (value == req.last_modified) {
         return Successful;
     }
     res.set_status_code(PreconditionFailed);
@@ -870,10 +1287,10 @@ ConditionCode http_server::if_unmodified_since(request& req, response& res)
 // server behaviors are required by the client.
 ConditionCode http_server::expect(request& req, response& res)
 {
-    auto it = req.headers().find("Expect");
-    if (it == req.headers().end()) return NoHeader;
+    auto value = req.header("Expect");
+    if (value.empty()) return NoHeader;
 
-    if (util::equal_case(it->second, "100-continue")) {
+    if (util::equal_case(value, "100-continue")) {
         return Successful;
     }
     res.set_status_code(ExpectationFailed);
@@ -899,8 +1316,8 @@ void http_server::send_file(request& req, response& res)
 
     res.add_header("Content-Length", std::to_string(req.filesize));
     res.send();
-    res.conn->send_file(fd, 0, req.filesize);
-    res.conn->set_send_complete_handler([fd](const connection_ptr& conn){ close(fd); });
+    res.write_file(fd, 0, req.filesize);
+    res.close_file(fd);
 }
 
 // Update or create a file
@@ -921,7 +1338,7 @@ void http_server::update_file(request& req, response& res)
     }
     res.set_status_code(req.has_file ? NoContent : Created);
     std::string location("http://");
-    location.append(req.headers().at("Host"));
+    location.append(req.header("Host"));
     location.append(req.path());
     res.add_header("Location", location);
     res.send();
@@ -1023,7 +1440,7 @@ void http_server::handle_range_request(request& req, response& res)
         res.set_status_code(RequestedRangeNotSatisfiable);
         res.add_header("Content-Range", content_range("*", range_set.filesize));
         res.send();
-        res.conn->close();
+        res.keepalive = false;
         return;
     case PartialContent:
         range_set.send_range_response(req, res);
@@ -1039,7 +1456,7 @@ void http_server::handle_range_request(request& req, response& res)
 // Ok: ignore the range request and return the entire file.
 StatusCode byte_range_set::parse_byte_ranges(request& req)
 {
-    std::string_view range(req.headers().at("Range"));
+    std::string_view range(req.header("Range"));
     if (!util::starts_with(range, "bytes=")) return Ok;
     range.remove_prefix(6);
     if (range.empty()) return Ok;
@@ -1139,8 +1556,8 @@ void byte_range_set::send_range_response(request& req, response& res)
         res.add_header("Content-Range", content_range(range.to_str(), filesize));
         res.add_header("Content-Length", std::to_string(range.length()));
         res.send();
-        res.conn->send_file(fd, range.first_byte_pos, range.length());
-        res.conn->set_send_complete_handler([fd](const connection_ptr& conn){ close(fd); });
+        res.write_file(fd, range.first_byte_pos, range.length());
+        res.close_file(fd);
         return;
     }
 
@@ -1153,14 +1570,14 @@ void byte_range_set::send_range_response(request& req, response& res)
         format_header(buf, "Content-Type", mime_type);
         format_header(buf, "Content-Range", content_range(range.to_str(), filesize));
         buf.append(CRLF);
-        res.conn->send(buf);
+        res.write(buf);
         buf.clear();
-        res.conn->send_file(fd, range.first_byte_pos, range.length());
+        res.write_file(fd, range.first_byte_pos, range.length());
         buf.append(CRLF);
     }
     buf.append("--").append(boundary).append("--").append(CRLF);
-    res.conn->send(buf);
-    res.conn->set_send_complete_handler([fd](const connection_ptr& conn){ close(fd); });
+    res.write(buf);
+    res.close_file(fd);
 }
 
 static const std::unordered_map<StatusCode, const char*> code_map = {
@@ -1216,13 +1633,16 @@ http_server::http_server(evloop *loop, inet_addr listen_addr)
 {
     server.set_connection_handler([this](const connection_ptr& conn){
             context ctx;
-            ctx.response.conn = conn.get();
+            ctx.server = this;
             conn->set_context(std::move(ctx));
             conn->set_ttl(this->idle_time * 1000);
             });
     server.set_message_handler([this](const connection_ptr& conn, buffer& buf){
             this->message_handler(conn, buf);
             });
+    server.set_close_handler([this](const connection_ptr& conn){
+            this->handle_close(conn);
+            });
     set_base_dir(".");
     set_idle(30); // 30s by default
 }
@@ -1239,12 +1659,31 @@ void http_server::set_parallel(unsigned n)
     server.start_io_threads(n);
 }
 
+void http_server::set_task_threads(unsigned n)
+{
+    if (n == 0) return;
+    server.start_task_threads(n);
+    async_handlers = true;
+}
+
+void http_server::set_pipeline_depth(unsigned n)
+{
+    if (n == 0) return;
+    pipeline_depth = n;
+}
+
 void http_server::set_idle(int secs)
 {
     if (secs <= 0) return;
     idle_time = secs;
 }
 
+void http_server::set_cork(bool on)
+{
+    cork = on;
+    server.set_cork(on);
+}
+
 void http_server::generate_file_etag_by(std::string_view way)
 {
     generate_file_etag_by_sha1 = (way == "sha1");
@@ -1252,13 +1691,32 @@ void http_server::generate_file_etag_by(std::string_view way)
 
 http_server& http_server::Get(std::string_view path, const ServerHandler handler)
 {
-    router[GET].emplace(path, std::move(handler));
-    return *this;
+    return Route(GET, path, std::move(handler));
 }
 
 http_server& http_server::Post(std::string_view path, const ServerHandler handler)
 {
-    router[POST].emplace(path, std::move(handler));
+    return Route(POST, path, std::move(handler));
+}
+
+http_server& http_server::Put(std::string_view path, const ServerHandler handler)
+{
+    return Route(PUT, path, std::move(handler));
+}
+
+http_server& http_server::Delete(std::string_view path, const ServerHandler handler)
+{
+    return Route(DELETE, path, std::move(handler));
+}
+
+http_server& http_server::Patch(std::string_view path, const ServerHandler handler)
+{
+    return Route(PATCH, path, std::move(handler));
+}
+
+http_server& http_server::Route(Method method, std::string_view path, const ServerHandler handler)
+{
+    routers[method].add(path, std::move(handler));
     return *this;
 }
 
@@ -0,0 +1,150 @@
+#include <angel/httplib.h>
+
+#include <angel/logger.h>
+
+namespace angel {
+namespace httplib {
+
+// e.g. add "/users", "/users/:id", "/users/:id/posts" and "/user*file":
+//
+// "/user"
+//    +-- "s"           <- /users
+//    |    +-- "/"
+//    |         +-- :id <- /users/:id
+//    |              +-- "/posts" <- /users/:id/posts
+//    +-- *file         <- /user*file
+//
+// The path of a static node is compressed, its children start with
+// different chars (see indices). A node has at most one param child
+// and one wildcard child, both of them have an empty path.
+struct router::node {
+    std::string path;
+    // The first char of the path of each static child.
+    std::string indices;
+    std::vector<std::unique_ptr<node>> children;
+    std::unique_ptr<node> param;
+    std::unique_ptr<node> wildcard;
+    // The name of the param or the wildcard.
+    std::string name;
+    ServerHandler handler;
+};
+
+router::router()
+    : root(new node())
+{
+}
+
+router::~router() = default;
+router::router(router&&) = default;
+router& router::operator=(router&&) = default;
+
+// Walk down from n by the static text s, split the nodes if necessary,
+// return the node at the end of s.
+router::node *router::insert_static(node *n, std::string_view s)
+{
+    while (!s.empty()) {
+        size_t i = n->indices.find(s[0]);
+        if (i == std::string::npos) {
+            auto *child = new node();
+            child->path = s;
+            n->indices.push_back(s[0]);
+            n->children.emplace_back(child);
+            return child;
+        }
+        auto *child = n->children[i].get();
+        auto diff = std::mismatch(s.begin(), s.end(), child->path.begin(), child->path.end());
+        size_t common = diff.first - s.begin();
+        if (common < child->path.size()) {
+            // Split the child at common:
+            // n -> "abcd" => n -> "ab" -> "cd"
+            auto *mid = new node();
+            mid->path = child->path.substr(0, common);
+            child->path.erase(0, common);
+            mid->indices.push_back(child->path[0]);
+            mid->children.emplace_back(n->children[i].release());
+            n->children[i].reset(mid);
+            child = mid;
+        }
+        s.remove_prefix(common);
+        n = child;
+    }
+    return n;
+}
+
+void router::add(std::string_view pattern, ServerHandler handler)
+{
+    std::string_view rest = pattern;
+    node *n = root.get();
+    while (!rest.empty()) {
+        size_t pos = rest.find_first_of(":*");
+        n = insert_static(n, rest.substr(0, pos));
+        if (pos == std::string_view::npos) break;
+        rest.remove_prefix(pos);
+
+        auto& child = (rest[0] == ':') ? n->param : n->wildcard;
+        std::string_view name;
+        if (rest[0] == ':') {
+            name = rest.substr(1, rest.find('/') - 1);
+            if (name.empty()) {
+                log_fatal("router: empty param name in %.*s", (int)pattern.size(), pattern.data());
+            }
+        } else {
+            name = rest.substr(1);
+            if (name.find('/') != std::string_view::npos) {
+                log_fatal("router: wildcard must be the last in %.*s", (int)pattern.size(), pattern.data());
+            }
+        }
+        if (!child) {
+            child.reset(new node());
+            child->name = name;
+        } else if (child->name != name) {
+            log_fatal("router: %.*s conflicts with the existing name \"%s\"",
+                      (int)pattern.size(), pattern.data(), child->name.c_str());
+        }
+        n = child.get();
+        rest.remove_prefix(name.size() + 1);
+    }
+    if (!n->handler) {
+        n->handler = std::move(handler);
+    }
+}
+
+// The path of n has been matched, match the rest (path) from its children.
+const ServerHandler *router::match(const node *n, std::string_view path,
+                                   std::vector<route_param>& params)
+{
+    if (!path.empty()) {
+        size_t i = n->indices.find(path[0]);
+        if (i != std::string::npos) {
+            auto *child = n->children[i].get();
+            if (util::starts_with(path, child->path)) {
+                auto *h = match(child, path.substr(child->path.size()), params);
+                if (h) return h;
+            }
+        }
+        if (n->param) {
+            auto value = path.substr(0, path.find('/'));
+            if (!value.empty()) {
+                params.push_back({ n->param->name, value });
+                auto *h = match(n->param.get(), path.substr(value.size()), params);
+                if (h) return h;
+                params.pop_back();
+            }
+        }
+    } else if (n->handler) {
+        return &n->handler;
+    }
+    if (n->wildcard && n->wildcard->handler) {
+        params.push_back({ n->wildcard->name, path });
+        return &n->wildcard->handler;
+    }
+    return nullptr;
+}
+
+const ServerHandler *router::find(std::string_view path, std::vector<route_param>& params) const
+{
+    return match(root.get(), path, params);
+}
+
+}
+}
@@ -7,6 +7,11 @@
 #include <angel/sockops.h>
 #include <angel/logger.h>
 #include <angel/util.h>
+#include <angel/config.h>
+
+#if defined (ANGEL_HAVE_IO_URING)
+#include "uring.h"
+#endif
 
 namespace angel {
 
@@ -20,13 +25,37 @@ listener_t::listener_t(evloop *loop, inet_addr listen_addr)
 
 listener_t::~listener_t()
 {
+    if (!listen_channel) return;
+#if defined (ANGEL_HAVE_IO_URING)
+    if (loop->uring) {
+        // The multishot accept must be canceled before the fd is closed
+        // by removing the channel.
+        loop->run_in_loop([loop = loop, chl = listen_channel]{
+                loop->uring->release(chl->fd());
+                chl->remove();
+                });
+        return;
+    }
+#endif
     listen_channel->remove();
 }
 
+void listener_t::copy_options(const listener_t& other)
+{
+    nodelay = other.nodelay;
+    keepalive = other.keepalive;
+    keepalive_idle = other.keepalive_idle;
+    keepalive_intvl = other.keepalive_intvl;
+    keepalive_probes = other.keepalive_probes;
+    reuseport = other.reuseport;
+    accept_batch = other.accept_batch;
+}
+
 void listener_t::listen()
 {
     int fd = sockops::socket();
     sockops::set_reuseaddr(fd, true);
+    if (reuseport) sockops::set_reuseport(fd, true);
     sockops::set_nodelay(fd, nodelay);
     sockops::set_keepalive(fd, keepalive);
     sockops::set_keepalive_idle(fd, keepalive_idle);
@@ -38,33 +67,71 @@ void listener_t::listen()
 
     listen_channel = new channel(loop, fd);
     listen_channel->set_read_handler([this]{ this->handle_accept(); });
+#if defined (ANGEL_HAVE_IO_URING)
+    // One multishot accept keeps accepting the connections,
+    // instead of accept(2) after every Read event.
+    if (loop->uring) {
+        loop->run_in_loop([this, fd]{
+                loop->uring->set_accept_handler(fd, [this](int res){
+                        this->handle_accept_completion(res);
+                        });
+                });
+    }
+#endif
     listen_channel->add();
 }
 
 void listener_t::handle_accept()
 {
-    int connfd = sockops::accept(listen_channel->fd());
-    if (connfd >= 0) {
-        log_info("Accept a new connection(fd=%d)", connfd);
-        sockops::set_nonblock(connfd);
-        if (onaccept) onaccept(connfd);
-        else close(connfd);
+    // Accept as many connections as possible during connection storms,
+    // and bound it to keep other events from starving.
+    for (size_t i = 0; i < accept_batch; i++) {
+        struct sockaddr_in peer_addr;
+        int connfd = sockops::accept_nonblock(listen_channel->fd(), &peer_addr);
+        if (connfd >= 0) {
+            new_connection(connfd, inet_addr(peer_addr));
+            continue;
+        }
+        if (!handle_accept_error()) return;
+    }
+}
+
+void listener_t::handle_accept_completion(int res)
+{
+    if (res >= 0) {
+        // The multishot accept can't return the peer address of each connection.
+        new_connection(res, inet_addr(sockops::get_peer_addr(res)));
         return;
     }
+    errno = -res;
+    handle_accept_error();
+}
+
+void listener_t::new_connection(int connfd, const inet_addr& peer_addr)
+{
+    log_info("Accept a new connection(fd=%d)", connfd);
+    accepted.fetch_add(1, std::memory_order_relaxed);
+    if (onaccept) onaccept(connfd, peer_addr);
+    else close(connfd);
+}
+
+bool listener_t::handle_accept_error()
+{
     switch (errno) {
     case EINTR:
-    case EWOULDBLOCK: // BSD
     case EPROTO: // SVR4
     case ECONNABORTED: // POSIX
-        break;
+        return true;
+    case EWOULDBLOCK: // BSD
+        return false;
     case EMFILE:
         close(idle_fd);
-        connfd = sockops::accept(listen_channel->fd());
-        close(connfd);
+        close(sockops::accept(listen_channel->fd()));
         idle_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        dropped.fetch_add(1, std::memory_order_relaxed);
     default:
         log_error("accept: %s", util::strerrno());
-        break;
+        return false;
     }
 }
 
@@ -2,6 +2,7 @@
 #define __ANGEL_LISTENER_H
 
 #include <memory>
+#include <atomic>
 #include <functional>
 
 #include <angel/inet_addr.h>
@@ -28,12 +29,26 @@ public:
     int keepalive_idle   = 0; // 0 will be ignored
     int keepalive_intvl  = 0; // 0 will be ignored
     int keepalive_probes = 0; // 0 will be ignored
+    bool reuseport = false;
+    // Accept at most accept_batch connections for every Read event.
+    size_t accept_batch = 16;
+
+    void copy_options(const listener_t& other);
 
     // Called (in loop thread) after accept(2) returns successfully.
-    // The accepted fd will be passed to onaccept(fd).
-    std::function<void(int)> onaccept;
+    // The accepted fd (non-blocking) and the peer address will be passed to onaccept().
+    std::function<void(int, const inet_addr&)> onaccept;
+
+    // Can be read from any thread.
+    std::atomic_size_t accepted{0};
+    std::atomic_size_t dropped{0}; // Dropped due to EMFILE
 private:
     void handle_accept();
+    // The completion of the multishot accept of io_uring.
+    void handle_accept_completion(int res);
+    void new_connection(int connfd, const inet_addr& peer_addr);
+    // Returns true if accept(2) can be retried.
+    bool handle_accept_error();
 
     evloop *loop;
     channel *listen_channel;
@@ -16,6 +16,7 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 
 #include <chrono>
 #include <iomanip>
@@ -329,8 +330,9 @@ ParseCode codec::parse_header(Headers& headers, buffer& buf)
             return Ok;
         }
 
-        auto pos = buf.find(":");
-        if (pos < 0) return Error;
+        auto *sep = (const char *)memchr(buf.peek(), ':', crlf);
+        if (!sep) return Error;
+        int pos = sep - buf.peek();
 
         std::string_view field(buf.peek(), pos);
         std::string_view value(util::trim({buf.peek() + pos + 1, (size_t)(crlf - pos - 1)}));
@@ -13,8 +13,14 @@ namespace angel {
 server::server(evloop *loop, inet_addr listen_addr)
     : loop(loop),
     listener(new listener_t(loop, listen_addr)),
-    conn_id(1),
-    high_water_mark(0)
+    conn_nums(0),
+    high_water_mark(0),
+    low_water_mark(0),
+    backpressure(false),
+    read_drain(false),
+    zerocopy_threshold(0),
+    edge_triggered(false),
+    cork(false)
 {
     // if (is_set_cpu_affinity)
         // util::set_thread_affinity(pthread_self(), 0);
@@ -38,64 +44,95 @@ evloop *server::get_next_loop()
     }
 }
 
-channel *server::make_channel(int fd)
+server::shard *server::get_shard(evloop *io_loop)
+{
+    if (shards.size() == 1) return shards[0].get();
+    for (auto& s : shards) {
+        if (s->loop == io_loop) return s.get();
+    }
+    log_fatal("No shard for the loop(%p)", io_loop);
+    return nullptr;
+}
+
+size_t server::new_conn_id(channel *chl)
+{
+    auto *s = get_shard(chl->get_loop());
+    return s->next_id.fetch_add(1, std::memory_order_relaxed) * shards.size() + s->index;
+}
+
+channel *server::make_channel(evloop *io_loop, int fd)
 {
-    evloop *io_loop = get_next_loop();
     channel *chl = new channel(io_loop, fd);
-    chl->add();
+    chl->set_edge_triggered(edge_triggered);
+    // In edge-triggered mode, the channel will be added after the connection
+    // is established, otherwise the first Read event may be triggered before
+    // the handlers are set, and we will never be notified again.
+    if (!chl->is_edge_triggered()) chl->add();
     return chl;
 }
 
-connection_ptr server::create_connection(channel *chl)
+connection_ptr server::create_connection(channel *chl, const inet_addr& peer_addr)
 {
-    return std::make_shared<connection>(conn_id++, chl);
+    return std::make_shared<connection>(new_conn_id(chl), chl, peer_addr);
 }
 
-void server::establish(channel *chl)
+void server::establish(channel *chl, const inet_addr& peer_addr)
 {
-    connection_ptr conn(create_connection(chl));
+    connection_ptr conn(create_connection(chl, peer_addr));
     conn->set_message_handler(message_handler);
     conn->set_high_water_mark_handler(high_water_mark, high_water_mark_handler);
+    conn->set_low_water_mark_handler(low_water_mark, low_water_mark_handler);
+    conn->set_backpressure(backpressure);
+    conn->set_read_drain(read_drain);
+    if (zerocopy_threshold > 0) conn->set_zerocopy(zerocopy_threshold);
+    // Before connection_handler, which may send data.
+    if (cork) conn->set_cork(true);
     conn->set_close_handler([this](const connection_ptr& conn){
             this->remove_connection(conn);
             });
-    connection_map.emplace(conn->id(), conn);
+    // No hop is needed in reuseport mode, the connection is owned by its io loop.
+    auto *s = get_shard(chl->get_loop());
+    s->loop->run_in_loop([this, s, conn]{
+            s->connection_map.emplace(conn->id(), conn);
+            conn_nums++;
+            });
     if (connection_handler) {
         conn->get_loop()->run_in_loop([this, conn]{
                 connection_handler(conn);
                 });
     }
+    if (chl->is_edge_triggered()) chl->add();
 }
 
 void server::remove_connection(const connection_ptr& conn)
 {
     if (close_handler) close_handler(conn);
-    // We must remove a connection in the main io loop thread to prevent
-    // multiple threads from concurrently modifying the connection_map.
-    loop->run_in_loop([this, id = conn->id()]{
-            this->connection_map.erase(id);
+    // We must remove a connection in the loop thread owning the shard to
+    // prevent multiple threads from concurrently modifying the connection_map.
+    // It is always queued, since the map may hold the last reference,
+    // and the connection is still on the stack (e.g. handle_read()).
+    auto *s = get_shard(conn->get_loop());
+    s->loop->queue_in_loop([this, s, id = conn->id()]{
+            if (s->connection_map.erase(id)) conn_nums--;
             });
 }
 
 connection_ptr server::get_connection(size_t id)
 {
-    Assert(loop->is_io_loop_thread());
-    auto it = connection_map.find(id);
-    return (it != connection_map.cend()) ? it->second : nullptr;
-}
-
-size_t server::get_connection_nums() const
-{
-    Assert(loop->is_io_loop_thread());
-    return connection_map.size();
+    if (shards.empty()) return nullptr;
+    auto *s = shards[id % shards.size()].get();
+    Assert(s->loop->is_io_loop_thread());
+    auto it = s->connection_map.find(id);
+    return (it != s->connection_map.cend()) ? it->second : nullptr;
 }
 
 void server::for_one(size_t id, const for_each_functor_t functor)
 {
-    if (!functor) return;
-    loop->run_in_loop([this, id = id, functor = std::move(functor)]{
-            auto it = connection_map.find(id);
-            if (it == connection_map.cend()) return;
+    if (!functor || shards.empty()) return;
+    auto *s = shards[id % shards.size()].get();
+    s->loop->run_in_loop([s, id = id, functor = std::move(functor)]{
+            auto it = s->connection_map.find(id);
+            if (it == s->connection_map.cend()) return;
             functor(it->second);
             });
 }
@@ -103,19 +140,20 @@ void server::for_one(size_t id, const for_each_functor_t functor)
 void server::for_each(const for_each_functor_t functor)
 {
     if (!functor) return;
-    loop->run_in_loop([this, functor = std::move(functor)]{
-            for (auto& it : this->connection_map)
-                functor(it.second);
-            });
+    for (auto& s : shards) {
+        s->loop->run_in_loop([s = s.get(), functor]{
+                for (auto& it : s->connection_map)
+                    functor(it.second);
+                });
+    }
 }
 
-void server::start_io_threads(size_t thread_nums)
+void server::start_io_threads(size_t thread_nums, evloop_options ops, placement_policy policy)
 {
-    if (thread_nums > 0) {
-        io_loop_group.reset(new evloop_group(thread_nums));
-    } else {
-        io_loop_group.reset(new evloop_group());
+    if (thread_nums == 0) {
+        thread_nums = std::thread::hardware_concurrency();
     }
+    io_loop_group.reset(new evloop_group(thread_nums, false, ops, policy));
 }
 
 void server::start_task_threads(size_t thread_nums, enum thread_pool::policy policy)
@@ -167,6 +205,30 @@ void server::set_keepalive_probes(int probes)
     listener->keepalive_probes = probes;
 }
 
+void server::set_reuseport(bool on)
+{
+    listener->reuseport = on;
+}
+
+void server::set_accept_batch(size_t n)
+{
+    listener->accept_batch = std::max<size_t>(n, 1);
+}
+
+accept_stats server::get_accept_stats() const
+{
+    accept_stats stats;
+    stats.accepted = listener->accepted;
+    stats.dropped = listener->dropped;
+    // The shards may not be created yet.
+    for (auto& s : shards) {
+        if (!s->listener) continue;
+        stats.accepted += s->listener->accepted;
+        stats.dropped += s->listener->dropped;
+    }
+    return stats;
+}
+
 void server::handle_signals()
 {
     // The SIGPIPE signal must be ignored, otherwise sending a message
@@ -180,7 +242,33 @@ void server::start()
 {
     handle_signals();
     log_info("Server (%s) is running", listener->addr().to_host());
-    listener->onaccept = [this](int fd){ this->establish(make_channel(fd)); };
+    if (edge_triggered && !supports_edge_triggered()) {
+        log_warn("The server doesn't support edge-triggered mode, ignore it");
+        edge_triggered = false;
+    }
+    if (listener->reuseport && io_loop_group && io_loop_group->size() > 0) {
+        for (size_t i = 0; i < io_loop_group->size(); i++) {
+            evloop *io_loop = io_loop_group->get_loop(i);
+            auto *s = new shard();
+            s->index = i;
+            s->loop = io_loop;
+            s->listener.reset(new listener_t(io_loop, listener->addr()));
+            s->listener->copy_options(*listener);
+            s->listener->onaccept = [this, io_loop](int fd, const inet_addr& peer_addr){
+                this->establish(make_channel(io_loop, fd), peer_addr);
+            };
+            shards.emplace_back(s);
+        }
+        for (auto& s : shards) s->listener->listen();
+        return;
+    }
+    auto *s = new shard();
+    s->index = 0;
+    s->loop = loop;
+    shards.emplace_back(s);
+    listener->onaccept = [this](int fd, const inet_addr& peer_addr){
+        this->establish(make_channel(get_next_loop(), fd), peer_addr);
+    };
     listener->listen();
 }
 
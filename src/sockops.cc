@@ -4,10 +4,17 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <string.h>
+#include <errno.h>
 
+#include <angel/config.h>
 #include <angel/util.h>
 #include <angel/logger.h>
 
+#if defined (ANGEL_HAVE_MSG_ZEROCOPY)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
 namespace angel {
 
 using namespace util;
@@ -74,6 +81,22 @@ int accept(int sockfd)
     return connfd;
 }
 
+// accept4() saves two fcntl(2) calls for every accepted fd.
+int accept_nonblock(int sockfd, struct sockaddr_in *peer_addr)
+{
+    socklen_t len = sizeof(*peer_addr);
+#ifdef ANGEL_HAVE_ACCEPT4
+    return ::accept4(sockfd, sockaddr_cast(peer_addr), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int connfd = ::accept(sockfd, sockaddr_cast(peer_addr), &len);
+    if (connfd >= 0) {
+        set_nonblock(connfd);
+        ::fcntl(connfd, F_SETFD, FD_CLOEXEC);
+    }
+    return connfd;
+#endif
+}
+
 // For SOCK_STREAM socket, connect() attempts to make a connection to peer socket.
 // For SOCK_DGRAM socket, connect() specifies the peer socket is that to which
 // datagrams are to be sent.
@@ -179,6 +202,20 @@ void set_reuseport(int fd, bool on)
         log_error("setsockopt(SO_REUSEPORT): %s", strerrno());
 }
 
+bool set_zerocopy(int fd, bool on)
+{
+#if defined (ANGEL_HAVE_MSG_ZEROCOPY)
+    int opt = on ? 1 : 0;
+    if (::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) < 0) {
+        log_warn("setsockopt(SO_ZEROCOPY): %s", strerrno());
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 void set_nodelay(int fd, bool on)
 {
     socklen_t opt = on ? 1 : 0;
@@ -254,5 +291,43 @@ ssize_t sendfile(int fd, int sockfd, off_t offset, off_t count)
 #endif
 }
 
+ssize_t send_zerocopy(int sockfd, const void *data, size_t len)
+{
+#if defined (ANGEL_HAVE_MSG_ZEROCOPY)
+    return ::send(sockfd, data, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int recv_zerocopy_completion(int sockfd, uint32_t *lo, uint32_t *hi, bool *copied)
+{
+#if defined (ANGEL_HAVE_MSG_ZEROCOPY)
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) return -1;
+    for (auto *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+            !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            continue;
+        auto *serr = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+        if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+        *lo = serr->ee_info;
+        *hi = serr->ee_data;
+        *copied = serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+        return 1;
+    }
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 }
 }
@@ -1,6 +1,7 @@
 #include "ssl_connection.h"
 
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <angel/util.h>
 #include <angel/logger.h>
@@ -8,53 +9,124 @@
 namespace angel {
 
 ssl_connection::ssl_connection(size_t id, class channel *chl, ssl_handshake *sh)
-    : connection(id, chl), sh(sh),
-    sf(std::make_unique<ssl_filter>(sh->get_ssl(), &decrypted, nullptr))
+    : connection(id, chl), sh(sh)
 {
+    init_ktls();
+}
+
+ssl_connection::ssl_connection(size_t id, class channel *chl, ssl_handshake *sh,
+                               const inet_addr& peer_addr)
+    : connection(id, chl, peer_addr), sh(sh)
+{
+    init_ktls();
 }
 
 ssl_connection::~ssl_connection()
 {
 }
 
+// If SSL_OP_ENABLE_KTLS was set, openssl has already installed the keys
+// to the socket by setsockopt(SOL_TLS) after the handshake, as long as
+// the kernel and the negotiated cipher support it.
+// Then we can use plain read()/write()/sendfile() with the kernel
+// doing the encryption, otherwise we fallback to the BIO path.
+void ssl_connection::init_ktls()
+{
+    // The records are written by ssl_filter, instead of being sent by io_uring.
+    uring_send = false;
+    SSL *ssl = sh->get_ssl();
+    ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    if (ktls_send || ktls_recv) {
+        log_info("connection(id=%zu, fd=%d): kTLS enabled (send=%d, recv=%d)",
+                 conn_id, channel->fd(), ktls_send, ktls_recv);
+    }
+    // The decrypted data comes from the socket directly with kTLS RX,
+    // and the kernel encrypts what we write with kTLS TX.
+    sf = std::make_unique<ssl_filter>(ssl, ktls_recv ? nullptr : &decrypted,
+                                      ktls_send ? nullptr : &encrypted, channel->fd());
+}
+
 void ssl_connection::handle_message()
 {
+    // A non-application-data record (e.g. an alert) makes read() fail with EIO,
+    // and then the connection will be closed.
+    if (ktls_recv) {
+        connection::handle_message();
+        return;
+    }
     sf->decrypt(&input_buf);
     if (decrypted.readable() > 0) {
         message_handler(shared_from_this(), decrypted);
     }
 }
 
+// The maximum plaintext size of a TLS record.
+static const size_t record_size = 16 * 1024;
+
+// Encrypt a record at a time until the socket is full, so that
+// at most one record is left in `encrypted`, which is sent first
+// by flush_pending_output() on the next Write event.
 ssize_t ssl_connection::write(const char *data, size_t len)
 {
+    if (ktls_send) return connection::write(data, len);
     SSL *ssl = sh->get_ssl();
-    int n = SSL_write(ssl, data, len);
-    log_debug("SSL_write (%d) bytes to connection(id=%zu, fd=%d)", n, conn_id, channel->fd());
-    if (n <= 0) {
-        int err = SSL_get_error(ssl, n);
-        if (err == SSL_ERROR_WANT_READ) {
-            log_warn("connection(id=%zu, fd=%d): SSL_ERROR_WANT_READ", conn_id, channel->fd());
-            return -1;
-        } else if (err == SSL_ERROR_WANT_WRITE) {
-            log_warn("connection(id=%zu, fd=%d): SSL_ERROR_WANT_WRITE", conn_id, channel->fd());
-            return -1;
-        } else {
-            char buf[256];
-            ERR_error_string(err, buf);
-            log_error("connection(id=%zu, fd=%d): OpenSSL: %s", conn_id, channel->fd(), buf);
-            force_close_connection();
-            return -2;
+    size_t written = 0;
+    while (written < len && encrypted.readable() == 0) {
+        int n = SSL_write(ssl, data + written, std::min(len - written, record_size));
+        if (n <= 0) {
+            int err = SSL_get_error(ssl, n);
+            if (err == SSL_ERROR_WANT_READ) {
+                log_warn("connection(id=%zu, fd=%d): SSL_ERROR_WANT_READ", conn_id, channel->fd());
+                break;
+            } else {
+                char buf[256];
+                ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+                log_error("connection(id=%zu, fd=%d): OpenSSL: %s (%s)",
+                          conn_id, channel->fd(), buf, util::strerrno());
+                force_close_connection();
+                return -2;
+            }
         }
+        written += n;
     }
-    return n;
+    log_debug("SSL_write (%zu) bytes to connection(id=%zu, fd=%d)", written, conn_id, channel->fd());
+    if (encrypted.readable() > 0) channel->enable_write();
+    return written > 0 ? written : -1;
+}
+
+bool ssl_connection::flush_pending_output()
+{
+    if (sf->flush() < 0) {
+        handle_error();
+        return false;
+    }
+    return encrypted.readable() == 0;
+}
+
+// SSL_write() writes one buffer at a time.
+ssize_t ssl_connection::writev(const struct iovec *iov, int iovcnt)
+{
+    if (ktls_send) return connection::writev(iov, iovcnt);
+    return write(static_cast<const char*>(iov[0].iov_base), iov[0].iov_len);
+}
+
+// The data must be encrypted, so it can't be sent by zerocopy.
+// (kTLS doesn't support MSG_ZEROCOPY either.)
+ssize_t ssl_connection::write_zerocopy(const char *data, size_t len,
+                                       const std::shared_ptr<const void>& owner)
+{
+    return write(data, len);
 }
 
 static const off_t ChunkSize = 1024 * 32;
 
-// SSL_sendfile() is available only when ktls(Kernel TLS) is enabled.
-// Here we fallback to mmap()/write().
+// With kTLS TX the kernel encrypts the file pages itself,
+// otherwise we fallback to mmap()/write().
 ssize_t ssl_connection::sendfile(int fd, off_t offset, off_t count)
 {
+    if (ktls_send) return connection::sendfile(fd, offset, count);
+
     off_t fix_off = util::page_aligned(offset);
     off_t diff  = offset - fix_off;
     off_t size  = std::min(ChunkSize, count) + diff;
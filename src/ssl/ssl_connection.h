@@ -11,15 +11,27 @@ namespace angel {
 class ssl_connection : public connection {
 public:
     ssl_connection(size_t id, class channel *, ssl_handshake *);
+    ssl_connection(size_t id, class channel *, ssl_handshake *, const inet_addr& peer_addr);
     ~ssl_connection();
 private:
+    void init_ktls();
     void handle_message() override;
     ssize_t write(const char *data, size_t len) override;
+    ssize_t writev(const struct iovec *iov, int iovcnt) override;
     ssize_t sendfile(int fd, off_t offset, off_t count) override;
+    ssize_t write_zerocopy(const char *data, size_t len,
+                           const std::shared_ptr<const void>& owner) override;
+    bool has_pending_output() const override { return encrypted.readable() > 0; }
+    bool flush_pending_output() override;
 
     std::shared_ptr<ssl_handshake> sh;
     std::unique_ptr<ssl_filter> sf;
     buffer decrypted;
+    // The encrypted records which the socket can't take for now.
+    buffer encrypted;
+    // Whether the kernel encrypts what we send (TX) or decrypts what we read (RX).
+    bool ktls_send = false;
+    bool ktls_recv = false;
 };
 
 }
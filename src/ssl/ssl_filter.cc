@@ -2,18 +2,83 @@
 
 #include <angel/logger.h>
 
+#include <unistd.h>
+
+#include <algorithm>
+
 namespace angel {
 
-ssl_filter::ssl_filter(SSL *ssl, buffer *decrypted, buffer *encrypted)
-    : ssl(ssl), decrypted(decrypted), encrypted(encrypted)
+// Reading from an empty buffer fails with the retry flag set,
+// the same as a non-blocking socket.
+int ssl_filter::bio_read(BIO *bio, char *data, int len)
+{
+    auto *sf = static_cast<ssl_filter*>(BIO_get_data(bio));
+    BIO_clear_retry_flags(bio);
+    if (!sf->input || sf->input->readable() == 0) {
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    int n = std::min(static_cast<size_t>(len), sf->input->readable());
+    memcpy(data, sf->input->peek(), n);
+    sf->input->retrieve(n);
+    return n;
+}
+
+int ssl_filter::bio_write(BIO *bio, const char *data, int len)
+{
+    auto *sf = static_cast<ssl_filter*>(BIO_get_data(bio));
+    BIO_clear_retry_flags(bio);
+    ssize_t n = 0;
+    // Keep the order if something is left.
+    if (sf->fd >= 0 && sf->encrypted->readable() == 0) {
+        n = ::write(sf->fd, data, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            n = 0;
+        }
+    }
+    sf->encrypted->append(data + n, len - n);
+    return len;
+}
+
+long ssl_filter::bio_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+    auto *sf = static_cast<ssl_filter*>(BIO_get_data(bio));
+    switch (cmd) {
+    case BIO_CTRL_PENDING:
+        return bio == sf->rbio && sf->input ? sf->input->readable() : 0;
+    case BIO_CTRL_FLUSH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+BIO_METHOD *ssl_filter::bio_method()
+{
+    static BIO_METHOD *method = []{
+        BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "angel buffer");
+        BIO_meth_set_read(m, bio_read);
+        BIO_meth_set_write(m, bio_write);
+        BIO_meth_set_ctrl(m, bio_ctrl);
+        BIO_meth_set_create(m, [](BIO *bio){ BIO_set_init(bio, 1); return 1; });
+        return m;
+    }();
+    return method;
+}
+
+ssl_filter::ssl_filter(SSL *ssl, buffer *decrypted, buffer *encrypted, int fd)
+    : ssl(ssl), input(nullptr), decrypted(decrypted), encrypted(encrypted), fd(fd)
 {
     rbio = wbio = nullptr;
     if (decrypted) {
-        rbio = BIO_new(BIO_s_mem());
+        rbio = BIO_new(bio_method());
+        BIO_set_data(rbio, this);
         SSL_set0_rbio(ssl, rbio);
     }
     if (encrypted) {
-        wbio = BIO_new(BIO_s_mem());
+        wbio = BIO_new(bio_method());
+        BIO_set_data(wbio, this);
         SSL_set0_wbio(ssl, wbio);
     }
 }
@@ -24,23 +89,19 @@ ssl_filter::~ssl_filter()
     // Invoking SSL_free() will indirectly free the affected BIO object.
 }
 
+// The maximum plaintext size of a TLS record.
+static const size_t record_size = 16 * 1024;
+
 void ssl_filter::decrypt(buffer *input)
 {
-    // Give the encrypted data read from the network to openssl for decryption.
-    if (input->readable() > 0) {
-        // Writes to memory BIOs will always succeed if memory is available:
-        // that is their size can grow indefinitely.
-        int n = BIO_write(rbio, input->peek(), input->readable());
-        if (n > 0) input->retrieve(n);
-    }
-
-    // Read the decrypted data from rbio.
+    // openssl reads the encrypted data from the network from `input` directly,
+    // and decrypts it into `decrypted`.
+    this->input = input;
     while (true) {
-        int n = SSL_read(ssl, buf, sizeof(buf));
-        if (n > 0) {
-            // The read operation was successful.
-            decrypted->append(buf, n);
-        } else {
+        decrypted->ensure_writeable(record_size);
+        int n = SSL_read(ssl, decrypted->end(), decrypted->writeable());
+        decrypted->has_written(n > 0 ? n : 0);
+        if (n <= 0) {
             // As at any time a re-negotiation is possible,
             // a call to SSL_read() can also cause write operations!
             int err = SSL_get_error(ssl, n);
@@ -55,30 +116,17 @@ void ssl_filter::decrypt(buffer *input)
     }
 }
 
-void ssl_filter::encrypt(buffer *output)
+ssize_t ssl_filter::flush()
 {
-    // Give the unencrypted data write to the network to openssl for encryption.
-    if (output->readable() > 0) {
-        int n = SSL_write(ssl, output->peek(), output->readable());
-        if (n > 0) {
-            output->retrieve(n);
-        } else {
-            // As at any time a re-negotiation is possible,
-            // a call to SSL_write() can also cause read operations!
-            int err = SSL_get_error(ssl, n);
-            if (err == SSL_ERROR_WANT_READ) {
-                log_error("SSL encrypt: SSL_ERROR_WANT_READ");
-            } else if (err == SSL_ERROR_WANT_WRITE) {
-                log_error("SSL encrypt: SSL_ERROR_WANT_WRITE");
-            }
+    while (encrypted->readable() > 0) {
+        ssize_t n = ::write(fd, encrypted->peek(), encrypted->readable());
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
         }
+        encrypted->retrieve(n);
     }
-
-    // Read the encrypted data from wbio.
-    while (true) {
-        int n = BIO_read(wbio, buf, sizeof(buf));
-        if (n > 0) encrypted->append(buf, n);
-    }
+    return encrypted->readable();
 }
 
 }
@@ -9,11 +9,18 @@
 
 namespace angel {
 
+// The filter replaces the BIOs of `ssl` with ones reading from and
+// writing to angel::buffer directly, so there is no extra copy
+// through a memory BIO.
 class ssl_filter {
 public:
     // If `encrypted` is nullptr, the filter will only be used for decryption.
     // If `decrypted` is nullptr, the filter will only be used for encryption.
-    ssl_filter(SSL *ssl, buffer *decrypted, buffer *encrypted);
+    //
+    // If `fd` is given, the encrypted data is written to the socket directly,
+    // only what the socket can't take for now is stored in `encrypted`,
+    // so SSL_write() never fails with SSL_ERROR_WANT_WRITE.
+    ssl_filter(SSL *ssl, buffer *decrypted, buffer *encrypted, int fd = -1);
     ~ssl_filter();
 
     ssl_filter(const ssl_filter&) = delete;
@@ -22,16 +29,22 @@ public:
     // Call after read from the network.
     // The decrypted data is stored in buffer `decrypted`.
     void decrypt(buffer *input);
-    // Call before write to the network.
-    // The encrypted data is stored in buffer `encrypted`.
-    void encrypt(buffer *output);
+    // Write the encrypted data stored in `encrypted` to the socket.
+    // Returns the number of bytes left, or -1 on error.
+    ssize_t flush();
 private:
+    static int bio_read(BIO *bio, char *data, int len);
+    static int bio_write(BIO *bio, const char *data, int len);
+    static long bio_ctrl(BIO *bio, int cmd, long num, void *ptr);
+    static BIO_METHOD *bio_method();
+
     SSL *ssl;
     BIO *rbio;
     BIO *wbio;
+    buffer *input;
     buffer *decrypted;
     buffer *encrypted;
-    char buf[1024];
+    int fd;
 };
 
 }
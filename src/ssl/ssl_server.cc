@@ -28,6 +28,7 @@ namespace {
     static std::string cert_file;
     static std::string key_passwd;
     static std::string key_file;
+    static bool enable_ktls = false;
 }
 
 static SSL_CTX *get_ssl_ctx()
@@ -61,25 +62,44 @@ static SSL_CTX *get_ssl_ctx()
         if (rc != 1) {
             log_fatal("SSL_CTX_check_private_key failed");
         }
+
+        if (enable_ktls) {
+#if defined (SSL_OP_ENABLE_KTLS)
+            SSL_CTX_set_options(ctx.get(), SSL_OP_ENABLE_KTLS);
+#else
+            log_warn("kTLS is not supported by this version of OpenSSL");
+#endif
+        }
     }
     return ctx.get();
 }
 
-connection_ptr ssl_server::create_connection(channel *chl)
+connection_ptr ssl_server::create_connection(channel *chl, const inet_addr& peer_addr)
 {
-    auto it = shmap.find(chl->fd());
-    Assert(it != shmap.end());
-    auto *sh = it->second.release();
-    shmap.erase(it);
-    return std::make_shared<ssl_connection>(conn_id++, chl, sh);
+    ssl_handshake *sh;
+    {
+        std::lock_guard<std::mutex> lk(shmap_lock);
+        auto it = shmap.find(chl->fd());
+        Assert(it != shmap.end());
+        sh = it->second.release();
+        shmap.erase(it);
+    }
+    return std::make_shared<ssl_connection>(new_conn_id(chl), chl, sh, peer_addr);
 }
 
-void ssl_server::establish(channel *chl)
+void ssl_server::establish(channel *chl, const inet_addr& peer_addr)
 {
     auto *sh = new ssl_handshake(chl, get_ssl_ctx());
-    shmap.emplace(chl->fd(), sh);
-    sh->onestablish = [this](channel *chl){ server::establish(chl); };
-    sh->onfail      = [this, fd = chl->fd()]{ shmap.erase(fd); };
+    {
+        // Handshakes may be started and finished in different io loops.
+        std::lock_guard<std::mutex> lk(shmap_lock);
+        shmap.emplace(chl->fd(), sh);
+    }
+    sh->onestablish = [this, peer_addr](channel *chl){ server::establish(chl, peer_addr); };
+    sh->onfail      = [this, fd = chl->fd()]{
+        std::lock_guard<std::mutex> lk(shmap_lock);
+        shmap.erase(fd);
+    };
     sh->start_server_handshake();
 }
 
@@ -103,4 +123,9 @@ void ssl_server::set_private_key_file(const char *your_key_file)
     key_file = your_key_file;
 }
 
+void ssl_server::set_ktls(bool on)
+{
+    enable_ktls = on;
+}
+
 }
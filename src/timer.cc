@@ -2,10 +2,16 @@
 
 #include <angel/evloop.h>
 #include <angel/logger.h>
+#include <angel/util.h>
 
 namespace angel {
 
-timer_t::timer_t(evloop *loop) : loop(loop), timer_id(1)
+static const size_t TimerChunkSize = 256;
+
+timer_t::timer_t(evloop *loop)
+    : loop(loop), free_tasks(nullptr), timer_id(1),
+    max_timers_per_tick(0), fired_this_tick(0),
+    fired(0), total_lateness(0), max_lateness(0), exhausted_ticks(0)
 {
 }
 
@@ -16,20 +22,38 @@ timer_t::~timer_t()
 
 int64_t timer_t::timeout()
 {
-    int64_t timeval;
-    if (!timer_set.empty()) {
-        timeval = (*timer_set.begin())->expire - util::get_cur_time_ms();
-        timeval = timeval > 0 ? timeval : 0;
-    } else
-        timeval = -1;
-    return timeval;
+    // There are still expired timers that have not been handled.
+    if (is_exhausted()) return 0;
+    return next_timeout();
 }
 
-size_t timer_t::add_timer(timer_task_t *task)
+void timer_t::tick()
 {
-    task->id = timer_id.fetch_add(1, std::memory_order_relaxed);
-    loop->run_in_loop([this, task]{ this->add_timer_in_loop(task); });
-    return task->id;
+    fired_this_tick = 0;
+    run_expired(util::get_cur_time_ms());
+    if (is_exhausted()) {
+        exhausted_ticks.fetch_add(1, std::memory_order_relaxed);
+        log_debug("Too many expired timers, the rest will be handled in the next tick");
+    }
+}
+
+timer_stats timer_t::get_stats() const
+{
+    timer_stats stats;
+    stats.fired = fired.load(std::memory_order_relaxed);
+    stats.total_lateness_ms = total_lateness.load(std::memory_order_relaxed);
+    stats.max_lateness_ms = max_lateness.load(std::memory_order_relaxed);
+    stats.exhausted_ticks = exhausted_ticks.load(std::memory_order_relaxed);
+    return stats;
+}
+
+size_t timer_t::add_timer(int64_t expire, int64_t interval, timer_callback_t cb)
+{
+    size_t id = timer_id.fetch_add(1, std::memory_order_relaxed);
+    loop->run_in_loop([this, id, expire, interval, cb = std::move(cb)]() mutable {
+            this->add_timer_in_loop(id, expire, interval, cb);
+            });
+    return id;
 }
 
 void timer_t::cancel_timer(size_t id)
@@ -38,56 +62,117 @@ void timer_t::cancel_timer(size_t id)
     loop->run_in_loop([this, id]{ this->cancel_timer_in_loop(id); });
 }
 
-// Add a timer task is O(log n)
-void timer_t::add_timer_in_loop(timer_task_t *task)
+void timer_t::refresh_timer(size_t id, int64_t timeout)
+{
+    if (id == 0) return;
+    loop->run_in_loop([this, id, timeout]{ this->refresh_timer_in_loop(id, timeout); });
+}
+
+void timer_t::add_timer_in_loop(size_t id, int64_t expire, int64_t interval, timer_callback_t& cb)
 {
-    timer_set.emplace(task);
-    timer_map.emplace(task->id, task);
+    auto *task = alloc_task();
+    task->id       = id;
+    task->expire   = expire;
+    task->interval = interval;
+    task->timer_cb = std::move(cb);
+    timer_map.emplace(id, task);
+    link(task);
 }
 
-// Cancel a timer task is O(log n)
 void timer_t::cancel_timer_in_loop(size_t id)
 {
-    auto iter = timer_map.find(id);
-    if (iter == timer_map.end()) return;
-    auto range = timer_set.equal_range(iter->second.get());
-    for (auto it = range.first; it != range.second; ++it) {
-        if ((*it)->id == id) {
-            log_debug("Cancel a timer(id=%d)", id);
-            timer_set.erase(it);
-            timer_map.erase(iter);
-            break;
-        }
+    auto it = timer_map.find(id);
+    if (it == timer_map.end()) return;
+    log_debug("Cancel a timer(id=%zu)", id);
+    auto *task = it->second;
+    timer_map.erase(it);
+    // The task is not linked while its timer_cb() is being executed,
+    // run() will free it after timer_cb() returns.
+    if (task->running) {
+        task->canceled = true;
+        return;
     }
+    unlink(task);
+    free_task(task);
 }
 
-void timer_t::tick()
+void timer_t::refresh_timer_in_loop(size_t id, int64_t timeout)
 {
-    int64_t now = util::get_cur_time_ms();
-    while (!timer_set.empty()) {
-        // Get the minimum timeout timer.
-        auto cur = *timer_set.begin();
-        if (cur->expire > now) break;
+    auto it = timer_map.find(id);
+    if (it == timer_map.end()) return;
+    auto *task = it->second;
+    auto expire = util::get_cur_time_ms() + timeout;
+    if (task->running) {
+        task->expire = expire;
+        task->refreshed = true;
+        return;
+    }
+    // The task must be unlinked before modifying its expire,
+    // timer_set_t looks for it by expire.
+    unlink(task);
+    task->expire = expire;
+    link(task);
+}
 
-        // Current timer may be canceled in timer_cb(),
-        // so we "delete" (release ownership to `guard`) it in advance.
-        auto it = timer_map.find(cur->id);
-        std::unique_ptr<timer_task_t> guard(it->second.release());
-        timer_set.erase(timer_set.begin());
-        timer_map.erase(it);
+void timer_t::run(timer_task_t *task, int64_t now)
+{
+    // How late is the timer executed than expected.
+    int64_t lateness = now - task->expire;
+    if (lateness < 0) lateness = 0;
+    fired.fetch_add(1, std::memory_order_relaxed);
+    total_lateness.fetch_add(lateness, std::memory_order_relaxed);
+    if (lateness > max_lateness.load(std::memory_order_relaxed)) {
+        max_lateness.store(lateness, std::memory_order_relaxed);
+    }
+    fired_this_tick++;
 
-        cur->timer_cb();
+    task->running = true;
+    task->timer_cb();
+    task->running = false;
 
+    if (task->canceled) {
+        free_task(task);
+    } else if (task->refreshed) {
+        task->refreshed = false;
+        link(task);
+    } else if (task->interval > 0) {
         // Update interval timer.
-        if (cur->interval > 0) {
-            // To avoid timing error accumulation,
-            // we should use `cur->expire` as new base expire time instead of `now`.
-            auto expire = cur->expire + cur->interval;
-            auto *task = new timer_task_t(expire, cur->interval, std::move(cur->timer_cb));
-            task->id = cur->id;
-            add_timer_in_loop(task);
+        //
+        // To avoid timing error accumulation,
+        // we should use `task->expire` as new base expire time instead of `now`.
+        task->expire += task->interval;
+        link(task);
+    } else {
+        timer_map.erase(task->id);
+        free_task(task);
+    }
+}
+
+timer_task_t *timer_t::alloc_task()
+{
+    if (!free_tasks) {
+        auto *chunk = new timer_task_t[TimerChunkSize];
+        for (size_t i = 0; i < TimerChunkSize; i++) {
+            chunk[i].next = free_tasks;
+            free_tasks = &chunk[i];
         }
+        chunks.emplace_back(chunk);
     }
+    auto *task = static_cast<timer_task_t*>(free_tasks);
+    free_tasks = free_tasks->next;
+    task->next = nullptr;
+    return task;
+}
+
+void timer_t::free_task(timer_task_t *task)
+{
+    // Release the resources captured by timer_cb as soon as possible.
+    task->timer_cb = nullptr;
+    task->id = 0;
+    task->canceled = task->refreshed = false;
+    task->prev = nullptr;
+    task->next = free_tasks;
+    free_tasks = task;
 }
 
 }
@@ -1,37 +1,33 @@
 #ifndef __ANGEL_TIMER_H
 #define __ANGEL_TIMER_H
 
-#include <set>
+#include <memory>
+#include <vector>
 #include <unordered_map>
-#include <arpa/inet.h>
-
-#include <angel/util.h>
+#include <functional>
+#include <atomic>
 
 namespace angel {
 
-struct timer_task_t {
-    typedef std::function<void()> timer_callback_t;
-    timer_task_t(int64_t expire_ms, int64_t interval_ms, const timer_callback_t cb)
-        : id(0),
-        expire(expire_ms),
-        interval(interval_ms),
-        timer_cb(cb)
-    {
-    }
-    size_t id;
-    int64_t expire; // timestamp (ms)
-    int64_t interval;
-    timer_callback_t timer_cb;
+// Intrusive doubly linked list node.
+struct timer_link {
+    timer_link *prev = nullptr;
+    timer_link *next = nullptr;
 };
 
-struct timer_task_cmp {
-    bool operator()(const timer_task_t *lhs, const timer_task_t *rhs) const
-    {
-        return lhs->expire < rhs->expire;
-    }
+struct timer_task_t : timer_link {
+    typedef std::function<void()> timer_callback_t;
+    size_t id = 0;
+    int64_t expire = 0; // timestamp (ms)
+    int64_t interval = 0;
+    timer_callback_t timer_cb;
+    bool running = false;   // timer_cb() is being executed
+    bool canceled = false;  // Canceled in its own timer_cb()
+    bool refreshed = false; // Refreshed in its own timer_cb()
 };
 
 class evloop;
+struct timer_stats;
 
 // There are three driving methods for timer:
 // 1) SIGALRM signal (But we generally avoid handling signals in a multi-threaded environment)
@@ -40,39 +36,75 @@ class evloop;
 //
 // There are also three data structures that implement it:
 // 1) Sorted List   (Get O(1), Add O(n))
-// 2) Minimum Heap or Balanced Binary Tree  (Get O(1), Add O(log n))
-// 3) Time Wheel    (Get O(1), Add O(1))
+// 2) Minimum Heap or Balanced Binary Tree  (Get O(1), Add O(log n)) (timer_set_t)
+// 3) Time Wheel    (Get O(1), Add O(1)) (timer_wheel_t)
+//
+// timer_t only manages timer ids and timer task nodes,
+// the derived class decides how to order the tasks by expiration time.
 class timer_t {
 public:
+    typedef timer_task_t::timer_callback_t timer_callback_t;
+
     explicit timer_t(evloop *loop);
-    ~timer_t();
+    virtual ~timer_t();
     timer_t(const timer_t&) = delete;
     timer_t& operator=(const timer_t&) = delete;
 
-    // Returns the minimum timeout value
-    //
-    // stl::set can get the node with the earliest timeout in O(1),
-    // which only needs to maintain a pointer to the node.
+    // Returns the minimum timeout value (ms),
+    // or -1 if there is no timer.
     int64_t timeout();
-    size_t add_timer(timer_task_t *task);
-    void cancel_timer(size_t id);
-    // Handle all expired timer events
+    // Handle expired timer events, at most `max_timers_per_tick` each time.
     void tick();
+
+    size_t add_timer(int64_t expire_ms, int64_t interval_ms, timer_callback_t cb);
+    void cancel_timer(size_t id);
+    // Reschedule the timer to expire after timeout (ms) from now.
+    void refresh_timer(size_t id, int64_t timeout_ms);
+
+    // 0 means no limit.
+    void set_max_timers_per_tick(size_t max) { max_timers_per_tick = max; }
+    timer_stats get_stats() const;
+protected:
+    virtual int64_t next_timeout() = 0;
+    // Execute tasks that expire before `now` until is_exhausted().
+    virtual void run_expired(int64_t now) = 0;
+    // Put the task into the underlying data structure.
+    virtual void link(timer_task_t *task) = 0;
+    // Remove the task from the underlying data structure.
+    virtual void unlink(timer_task_t *task) = 0;
+    // Execute an expired task, which must have been unlinked.
+    void run(timer_task_t *task, int64_t now);
+    // The budget of the current tick has been used up.
+    bool is_exhausted() const
+    {
+        return max_timers_per_tick > 0 && fired_this_tick >= max_timers_per_tick;
+    }
 private:
-    void add_timer_in_loop(timer_task_t *task);
+    void add_timer_in_loop(size_t id, int64_t expire, int64_t interval, timer_callback_t& cb);
     void cancel_timer_in_loop(size_t id);
+    void refresh_timer_in_loop(size_t id, int64_t timeout);
+
+    timer_task_t *alloc_task();
+    void free_task(timer_task_t *task);
 
     evloop *loop;
-    // The timer task needs to be stored in order by expiration time,
-    // so that we can execute the scheduled task according to the expiration time.
-    //
-    // And because expire may be repeated, we use multiset.
-    std::multiset<timer_task_t*, timer_task_cmp> timer_set;
     // Let us find a timer task by id in O(1)
-    std::unordered_map<size_t, std::unique_ptr<timer_task_t>> timer_map;
+    std::unordered_map<size_t, timer_task_t*> timer_map;
+    // The task nodes are allocated in chunks and reused through free_tasks,
+    // so that adding a timer does not need to allocate memory in most cases.
+    std::vector<std::unique_ptr<timer_task_t[]>> chunks;
+    timer_link *free_tasks;
     // Global increment id (increments from 1)
     // In this way, when timer_id is 0, we consider it not a valid timer task.
     std::atomic_size_t timer_id;
+
+    size_t max_timers_per_tick;
+    size_t fired_this_tick;
+    // Only be updated in loop thread, and can be read from any thread.
+    std::atomic_size_t fired;
+    std::atomic<int64_t> total_lateness;
+    std::atomic<int64_t> max_lateness;
+    std::atomic_size_t exhausted_ticks;
 };
 }
 
@@ -0,0 +1,55 @@
+#include "timer_set.h"
+
+#include <angel/util.h>
+
+namespace angel {
+
+timer_set_t::timer_set_t(evloop *loop) : timer_t(loop)
+{
+}
+
+timer_set_t::~timer_set_t()
+{
+}
+
+int64_t timer_set_t::next_timeout()
+{
+    int64_t timeval;
+    if (!timer_set.empty()) {
+        timeval = (*timer_set.begin())->expire - util::get_cur_time_ms();
+        timeval = timeval > 0 ? timeval : 0;
+    } else
+        timeval = -1;
+    return timeval;
+}
+
+// Add a timer task is O(log n)
+void timer_set_t::link(timer_task_t *task)
+{
+    timer_set.emplace(task);
+}
+
+// Remove a timer task is O(log n)
+void timer_set_t::unlink(timer_task_t *task)
+{
+    auto range = timer_set.equal_range(task);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (*it == task) {
+            timer_set.erase(it);
+            break;
+        }
+    }
+}
+
+void timer_set_t::run_expired(int64_t now)
+{
+    while (!timer_set.empty() && !is_exhausted()) {
+        // Get the minimum timeout timer.
+        auto *task = *timer_set.begin();
+        if (task->expire > now) break;
+        timer_set.erase(timer_set.begin());
+        run(task, now);
+    }
+}
+
+}
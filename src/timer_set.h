@@ -0,0 +1,40 @@
+#ifndef __ANGEL_TIMER_SET_H
+#define __ANGEL_TIMER_SET_H
+
+#include <set>
+
+#include "timer.h"
+
+namespace angel {
+
+struct timer_task_cmp {
+    bool operator()(const timer_task_t *lhs, const timer_task_t *rhs) const
+    {
+        return lhs->expire < rhs->expire;
+    }
+};
+
+// Add O(log n), Cancel O(log n)
+class timer_set_t : public timer_t {
+public:
+    explicit timer_set_t(evloop *loop);
+    ~timer_set_t();
+
+private:
+    // stl::set can get the node with the earliest timeout in O(1),
+    // which only needs to maintain a pointer to the node.
+    int64_t next_timeout() override;
+    void run_expired(int64_t now) override;
+    void link(timer_task_t *task) override;
+    void unlink(timer_task_t *task) override;
+
+    // The timer task needs to be stored in order by expiration time,
+    // so that we can execute the scheduled task according to the expiration time.
+    //
+    // And because expire may be repeated, we use multiset.
+    std::multiset<timer_task_t*, timer_task_cmp> timer_set;
+};
+
+}
+
+#endif // __ANGEL_TIMER_SET_H
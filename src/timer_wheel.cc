@@ -0,0 +1,169 @@
+#include "timer_wheel.h"
+
+#include <angel/util.h>
+
+namespace angel {
+
+static void list_init(timer_link *head)
+{
+    head->prev = head->next = head;
+}
+
+static bool list_empty(const timer_link *head)
+{
+    return head->next == head;
+}
+
+static void list_add_tail(timer_link *node, timer_link *head)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_del(timer_link *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+// Move all nodes of `from` to `to`, and `from` becomes empty.
+static void list_replace_init(timer_link *from, timer_link *to)
+{
+    if (list_empty(from)) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+timer_wheel_t::timer_wheel_t(evloop *loop)
+    : timer_t(loop),
+    current(util::get_cur_time_ms()),
+    task_nums(0)
+{
+    for (auto& head : tv1) list_init(&head);
+    for (auto& tv : tvn) {
+        for (auto& head : tv) list_init(&head);
+    }
+}
+
+timer_wheel_t::~timer_wheel_t()
+{
+}
+
+void timer_wheel_t::link(timer_task_t *task)
+{
+    // The wheel may not tick for a long time when it is empty,
+    // so catch up with the time before adding the first task.
+    if (task_nums == 0) {
+        current = std::max(current, util::get_cur_time_ms());
+    }
+    add_to_wheel(task);
+    task_nums++;
+}
+
+void timer_wheel_t::unlink(timer_task_t *task)
+{
+    list_del(task);
+    task_nums--;
+}
+
+void timer_wheel_t::add_to_wheel(timer_task_t *task)
+{
+    int64_t expire = task->expire;
+    int64_t idx = expire - current;
+    timer_link *head;
+
+    if (idx < 0) {
+        // It has expired, and will be processed at the next tick.
+        head = &tv1[current & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        head = &tv1[expire & TVR_MASK];
+    } else if (idx < (1 << (TVR_BITS + TVN_BITS))) {
+        head = &tvn[0][(expire >> TVR_BITS) & TVN_MASK];
+    } else if (idx < (1 << (TVR_BITS + 2 * TVN_BITS))) {
+        head = &tvn[1][(expire >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+    } else if (idx < (1 << (TVR_BITS + 3 * TVN_BITS))) {
+        head = &tvn[2][(expire >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK];
+    } else {
+        // The maximum timeout we can hold is about 49 days,
+        // larger timeout will be cascaded again later.
+        if (idx > 0xffffffffLL) {
+            expire = current + 0xffffffffLL;
+        }
+        head = &tvn[3][(expire >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK];
+    }
+    list_add_tail(task, head);
+}
+
+// Re-add all tasks of tvn[level][index] to the wheel,
+// they will be moved to the lower level.
+int timer_wheel_t::cascade(int level, int index)
+{
+    timer_link head;
+    list_replace_init(&tvn[level][index], &head);
+    while (!list_empty(&head)) {
+        auto *task = static_cast<timer_task_t*>(head.next);
+        list_del(task);
+        add_to_wheel(task);
+    }
+    return index;
+}
+
+#define INDEX(n) ((current >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+int64_t timer_wheel_t::next_timeout()
+{
+    if (task_nums == 0) return -1;
+    int64_t expire = current;
+    // Stop at the next cascade point.
+    while ((expire & TVR_MASK) != 0 && list_empty(&tv1[expire & TVR_MASK])) {
+        expire++;
+    }
+    int64_t timeval = expire - util::get_cur_time_ms();
+    return timeval > 0 ? timeval : 0;
+}
+
+void timer_wheel_t::run_expired(int64_t now)
+{
+    if (task_nums == 0) {
+        // Nothing to do, just catch up with the time.
+        if (current <= now) current = now + 1;
+        return;
+    }
+    while (current <= now) {
+        int index = current & TVR_MASK;
+        if (!index &&
+            !cascade(0, INDEX(0)) &&
+            !cascade(1, INDEX(1)) &&
+            !cascade(2, INDEX(2))) {
+            cascade(3, INDEX(3));
+        }
+        // New expired tasks may be added to this slot in timer_cb(),
+        // so we always take the first one.
+        while (true) {
+            auto *head = &tv1[current & TVR_MASK];
+            if (list_empty(head)) break;
+            // Keep `current` unchanged, and continue from here next time.
+            //
+            // It doesn't matter if the cascade is done again,
+            // tasks will still be added to the same or lower level.
+            if (is_exhausted()) return;
+            auto *task = static_cast<timer_task_t*>(head->next);
+            unlink(task);
+            run(task, now);
+        }
+        current++;
+    }
+}
+
+#undef INDEX
+
+}
@@ -0,0 +1,55 @@
+#ifndef __ANGEL_TIMER_WHEEL_H
+#define __ANGEL_TIMER_WHEEL_H
+
+#include "timer.h"
+
+namespace angel {
+
+// Hierarchical timing wheel (similar to the classic linux kernel timer wheel)
+//
+// The resolution is 1ms, and there are 5 levels of wheels:
+// tv1: 256 slots, every slot is 1ms.
+// tv2: 64 slots,  every slot is 256ms.
+// tv3: 64 slots,  every slot is 256 * 64ms.
+// tv4: 64 slots,  every slot is 256 * 64 * 64ms.
+// tv5: 64 slots,  every slot is 256 * 64 * 64 * 64ms.
+//
+// Every slot is an intrusive doubly linked list,
+// so add, cancel and refresh a timer are all O(1).
+//
+// When tv1 goes around, the next slot of tv2 will be cascaded into tv1,
+// and so on for higher levels.
+class timer_wheel_t : public timer_t {
+public:
+    explicit timer_wheel_t(evloop *loop);
+    ~timer_wheel_t();
+
+private:
+    // We can't get the earliest task in O(1), so we only look for it in tv1.
+    // If tv1 is empty, returns the time left to the next cascade.
+    int64_t next_timeout() override;
+    void run_expired(int64_t now) override;
+    void link(timer_task_t *task) override;
+    void unlink(timer_task_t *task) override;
+
+    void add_to_wheel(timer_task_t *task);
+    int cascade(int level, int index);
+
+    static const int TVR_BITS = 8;
+    static const int TVN_BITS = 6;
+    static const int TVR_SIZE = 1 << TVR_BITS;
+    static const int TVN_SIZE = 1 << TVN_BITS;
+    static const int TVR_MASK = TVR_SIZE - 1;
+    static const int TVN_MASK = TVN_SIZE - 1;
+    static const int TVN_LEVELS = 4;
+
+    timer_link tv1[TVR_SIZE];
+    timer_link tvn[TVN_LEVELS][TVN_SIZE];
+    // All tasks that expire before `current` have been processed.
+    int64_t current;
+    size_t task_nums;
+};
+
+}
+
+#endif // __ANGEL_TIMER_WHEEL_H
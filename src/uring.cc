@@ -0,0 +1,600 @@
+#include <angel/config.h>
+
+#ifdef ANGEL_HAVE_IO_URING
+
+#include "uring.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <iterator>
+
+#include <angel/evloop.h>
+#include <angel/logger.h>
+#include <angel/util.h>
+
+namespace angel {
+
+using namespace util;
+
+// The user_data of IORING_OP_POLL_REMOVE and IORING_OP_ASYNC_CANCEL,
+// their completions are ignored.
+static const uint64_t POLL_REMOVE_DATA = UINT64_MAX;
+static const uint64_t CANCEL_DATA = UINT64_MAX - 1;
+// The user_data of an operation is OP_DATA | seq << 32 | index,
+// and the one of a poll request is gen << 32 | fd.
+static const uint64_t OP_DATA = 1ull << 63;
+static const uint32_t SEQ_MASK = 0x7fffffff;
+
+static const unsigned URING_ENTRIES = 256;
+
+// The provided buffers of multishot recv,
+// the number of them must be a power of 2.
+static const unsigned BUF_ENTRIES = 1024;
+static const size_t BUF_SIZE = 4096;
+static const uint16_t BUF_GROUP = 0;
+
+static uint64_t poll_data(int fd, uint32_t gen)
+{
+    return (static_cast<uint64_t>(gen & SEQ_MASK) << 32) | static_cast<uint32_t>(fd);
+}
+
+io_uring_base_t::io_uring_base_t()
+{
+    if (!setup(URING_ENTRIES)) {
+        if (ring_fd >= 0) close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+    evmap.resize(EVLIST_INIT_SIZE);
+    set_name("io_uring");
+}
+
+io_uring_base_t::~io_uring_base_t()
+{
+    if (sqes) munmap(sqes, sqes_size);
+    if (sq_ptr) munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+    if (buf_ring) munmap(buf_ring, buf_ring_size);
+}
+
+bool io_uring_base_t::setup(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // There is at most one poll request for every fd,
+    // so the number of completions may be larger than sq entries.
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 16;
+
+    ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring_fd < 0) {
+        log_warn("io_uring_setup: %s", strerrno());
+        return false;
+    }
+    // We need IORING_ENTER_EXT_ARG to wait with a timeout (linux 5.11),
+    // and which also implies IORING_FEAT_SINGLE_MMAP.
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        log_warn("io_uring: IORING_FEAT_EXT_ARG is not supported");
+        return false;
+    }
+
+    sq_entries = p.sq_entries;
+    cq_entries = p.cq_entries;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size) sq_size = cq_size;
+
+    void *ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        log_warn("io_uring mmap: %s", strerrno());
+        return false;
+    }
+    sq_ptr = ptr;
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        log_warn("io_uring mmap: %s", strerrno());
+        return false;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(ptr);
+
+    char *base = static_cast<char*>(sq_ptr);
+    sq_head  = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+    sq_tail  = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+    sq_mask  = reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+    cq_head  = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+    cq_tail  = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+    cq_mask  = reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+    cqes     = reinterpret_cast<struct io_uring_cqe*>(base + p.cq_off.cqes);
+
+    // The opcodes may be restricted, or not supported by an older kernel.
+    auto ops = probe_ops();
+    if (!ops[IORING_OP_POLL_ADD] || !ops[IORING_OP_POLL_REMOVE]) {
+        log_warn("io_uring: IORING_OP_POLL_ADD is not supported");
+        return false;
+    }
+    bool cancel = ops[IORING_OP_ASYNC_CANCEL];
+    send_supported = cancel && ops[IORING_OP_SENDMSG];
+#if defined (IORING_RECV_MULTISHOT)
+    // There are no probes for the multishot flags (linux 5.19 and 6.0),
+    // they are disabled by the first completion with -EINVAL if the kernel
+    // doesn't support them (see disable_multishot()).
+    multishot_accept = cancel && ops[IORING_OP_ACCEPT];
+    multishot_recv = cancel && ops[IORING_OP_RECV] && setup_buf_ring();
+#endif
+    return true;
+}
+
+std::vector<bool> io_uring_base_t::probe_ops()
+{
+    const unsigned nr_ops = 256;
+    std::vector<bool> ops(nr_ops);
+    size_t len = sizeof(struct io_uring_probe) + nr_ops * sizeof(struct io_uring_probe_op);
+    std::unique_ptr<char[]> buf(new char[len]());
+    auto *probe = reinterpret_cast<struct io_uring_probe*>(buf.get());
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, nr_ops) < 0) {
+        log_warn("io_uring_register(IORING_REGISTER_PROBE): %s", strerrno());
+        return ops;
+    }
+    for (unsigned i = 0; i < probe->ops_len && i < nr_ops; i++) {
+        if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) ops[probe->ops[i].op] = true;
+    }
+    return ops;
+}
+
+void io_uring_base_t::disable_multishot(op_type type)
+{
+    bool& supported = type == Accept ? multishot_accept : multishot_recv;
+    if (!supported) return;
+    supported = false;
+    log_warn("io_uring: multishot %s is not supported, use the poll requests",
+             type == Accept ? "accept" : "recv");
+    // The Read events are served by the poll requests and the read handlers
+    // of the channels instead.
+    for (size_t fd = 0; fd < evmap.size(); fd++) {
+        auto& st = evmap[fd];
+        bool handler_set = type == Accept ? static_cast<bool>(st.accept_handler)
+                                           : static_cast<bool>(st.recv_handler);
+        if (!handler_set) continue;
+        int old_poll_events = poll_events(st);
+        if (type == Accept) st.accept_handler = nullptr;
+        else st.recv_handler = nullptr;
+        update(fd, old_poll_events);
+    }
+}
+
+bool io_uring_base_t::setup_buf_ring()
+{
+#if defined (IORING_RECV_MULTISHOT)
+    buf_ring_size = BUF_ENTRIES * sizeof(struct io_uring_buf);
+    void *ptr = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        log_warn("io_uring mmap: %s", strerrno());
+        return false;
+    }
+    buf_ring = static_cast<struct io_uring_buf_ring*>(ptr);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = BUF_ENTRIES;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_warn("io_uring_register(IORING_REGISTER_PBUF_RING): %s", strerrno());
+        munmap(buf_ring, buf_ring_size);
+        buf_ring = nullptr;
+        return false;
+    }
+    bufs.reset(new char[BUF_ENTRIES * BUF_SIZE]);
+    for (unsigned bid = 0; bid < BUF_ENTRIES; bid++) {
+        give_back_buf(bid);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void io_uring_base_t::give_back_buf(unsigned bid)
+{
+    // The tail of the ring overlays the resv of bufs[0], which is not touched.
+    // (buf_ring->bufs is not at offset 0 in C++, since __DECLARE_FLEX_ARRAY
+    // puts an empty struct before it.)
+    auto *buf = reinterpret_cast<struct io_uring_buf*>(buf_ring) + (buf_tail & (BUF_ENTRIES - 1));
+    buf->addr = reinterpret_cast<uint64_t>(bufs.get() + bid * BUF_SIZE);
+    buf->len  = BUF_SIZE;
+    buf->bid  = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *io_uring_base_t::get_sqe()
+{
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        // The submission queue is full, flush it first.
+        if (submit_and_wait(0, 0) < 0)
+            log_error("io_uring_enter: %s", strerrno());
+    }
+    unsigned index = tail & *sq_mask;
+    auto *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+    return sqe;
+}
+
+void io_uring_base_t::poll_add(int fd)
+{
+    auto& st = evmap[fd];
+    int events = poll_events(st);
+    unsigned poll_events = 0;
+    if (events & Read) poll_events |= POLLIN;
+    if (events & Write) poll_events |= POLLOUT;
+    st.gen++;
+    st.armed = true;
+
+    auto *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_events;
+    sqe->user_data = poll_data(fd, st.gen);
+}
+
+void io_uring_base_t::poll_remove(int fd)
+{
+    auto& st = evmap[fd];
+    st.armed = false;
+
+    auto *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = poll_data(fd, st.gen);
+    sqe->user_data = POLL_REMOVE_DATA;
+}
+
+bool io_uring_base_t::is_completion_read(const fd_state& st) const
+{
+    return (st.filter & Read) && (st.accept_handler || st.recv_handler);
+}
+
+int io_uring_base_t::poll_events(const fd_state& st) const
+{
+    int events = st.filter & (Read | Write);
+    if (is_completion_read(st)) events &= ~Read;
+    return events;
+}
+
+void io_uring_base_t::update(int fd, int old_poll_events)
+{
+    auto& st = evmap[fd];
+    int events = poll_events(st);
+    if (events != old_poll_events) {
+        // Replace the pending poll request with the new events.
+        if (st.armed) poll_remove(fd);
+        if (events) poll_add(fd);
+    }
+    if (is_completion_read(st)) {
+        if (st.read_op < 0) start_read(fd);
+    } else if (st.read_op >= 0) {
+        cancel_op(st.read_op);
+        st.read_op = -1;
+    }
+}
+
+void io_uring_base_t::rearm(int fd)
+{
+    auto& st = evmap[fd];
+    if (poll_events(st) && !st.armed) poll_add(fd);
+    if (is_completion_read(st) && st.read_op < 0) start_read(fd);
+}
+
+void io_uring_base_t::add(int fd, int events)
+{
+    resize_if(fd, evmap);
+
+    auto& st = evmap[fd];
+    if ((st.filter | events) == st.filter) return;
+    int old_poll_events = poll_events(st);
+    st.filter |= events;
+    update(fd, old_poll_events);
+}
+
+void io_uring_base_t::remove(int fd, int events)
+{
+    if (fd >= static_cast<int>(evmap.size())) return;
+
+    auto& st = evmap[fd];
+    if ((st.filter & events) == 0) return;
+    int old_poll_events = poll_events(st);
+    st.filter &= ~events;
+    update(fd, old_poll_events);
+}
+
+void io_uring_base_t::set_accept_handler(int fd, accept_handler_t handler)
+{
+    if (!multishot_accept) return;
+    resize_if(fd, evmap);
+
+    auto& st = evmap[fd];
+    int old_poll_events = poll_events(st);
+    st.accept_handler = std::move(handler);
+    update(fd, old_poll_events);
+}
+
+void io_uring_base_t::set_recv_handler(int fd, recv_handler_t handler)
+{
+    if (!multishot_recv) return;
+    resize_if(fd, evmap);
+
+    auto& st = evmap[fd];
+    int old_poll_events = poll_events(st);
+    st.recv_handler = std::move(handler);
+    update(fd, old_poll_events);
+}
+
+void io_uring_base_t::release(int fd)
+{
+    if (fd >= static_cast<int>(evmap.size())) return;
+
+    auto& st = evmap[fd];
+    int old_poll_events = poll_events(st);
+    st.epoch++;
+    st.accept_handler = nullptr;
+    st.recv_handler = nullptr;
+    // Its handler will be called with -ECANCELED,
+    // unless it has been completed.
+    if (st.send_op >= 0) {
+        cancel_op(st.send_op);
+        st.send_op = -1;
+    }
+    update(fd, old_poll_events);
+}
+
+int io_uring_base_t::alloc_op(op_type type, int fd)
+{
+    int index;
+    if (free_ops.empty()) {
+        index = ops.size();
+        ops.emplace_back(new op());
+    } else {
+        index = free_ops.back();
+        free_ops.pop_back();
+    }
+    auto *o = ops[index].get();
+    o->type = type;
+    o->fd = fd;
+    o->seq++;
+    o->epoch = evmap[fd].epoch;
+    return index;
+}
+
+void io_uring_base_t::free_op(int index)
+{
+    ops[index]->send_handler = nullptr;
+    free_ops.push_back(index);
+}
+
+uint64_t io_uring_base_t::op_data(int index) const
+{
+    uint64_t seq = ops[index]->seq & SEQ_MASK;
+    return OP_DATA | (seq << 32) | static_cast<uint32_t>(index);
+}
+
+void io_uring_base_t::cancel_op(int index)
+{
+    auto *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = op_data(index);
+    sqe->user_data = CANCEL_DATA;
+}
+
+void io_uring_base_t::start_read(int fd)
+{
+#if defined (IORING_RECV_MULTISHOT)
+    auto& st = evmap[fd];
+    bool accept = static_cast<bool>(st.accept_handler);
+    int index = alloc_op(accept ? Accept : Recv, fd);
+    st.read_op = index;
+
+    auto *sqe = get_sqe();
+    sqe->fd = fd;
+    sqe->user_data = op_data(index);
+    if (accept) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+    }
+#endif
+}
+
+void io_uring_base_t::send(int fd, const struct iovec *iov, int iovcnt, send_handler_t handler)
+{
+    resize_if(fd, evmap);
+
+    int index = alloc_op(Send, fd);
+    auto *o = ops[index].get();
+    iovcnt = std::min<int>(iovcnt, std::size(o->iov));
+    std::copy(iov, iov + iovcnt, o->iov);
+    memset(&o->msg, 0, sizeof(o->msg));
+    o->msg.msg_iov = o->iov;
+    o->msg.msg_iovlen = iovcnt;
+    o->send_handler = std::move(handler);
+    evmap[fd].send_op = index;
+
+    auto *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&o->msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = op_data(index);
+}
+
+// The handlers may change evmap, so no reference to it is held across them.
+void io_uring_base_t::complete(const completion& c)
+{
+    int index = static_cast<int>(c.user_data & 0xffffffff);
+    auto *o = ops[index].get();
+    bool has_buf = c.flags & IORING_CQE_F_BUFFER;
+    unsigned bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+    if ((o->seq & SEQ_MASK) != ((c.user_data >> 32) & SEQ_MASK)) {
+        log_error("io_uring: the completion of a stale operation(index=%d)", index);
+        if (has_buf) give_back_buf(bid);
+        return;
+    }
+    int fd = o->fd;
+    bool current = o->epoch == evmap[fd].epoch;
+
+    if (o->type != Send && c.res == -EINVAL && !(c.flags & IORING_CQE_F_MORE)) {
+        if (evmap[fd].read_op == index) evmap[fd].read_op = -1;
+        op_type type = o->type;
+        free_op(index);
+        disable_multishot(type);
+        return;
+    }
+
+    switch (o->type) {
+    case Accept:
+        if (current && c.res != -ECANCELED && evmap[fd].accept_handler) {
+            auto handler = evmap[fd].accept_handler;
+            handler(c.res);
+        } else if (c.res >= 0) {
+            close(c.res);
+        }
+        break;
+    case Recv:
+        // Out of buffers (-ENOBUFS), the recv will be rearmed.
+        if (current && c.res != -ECANCELED && c.res != -ENOBUFS && evmap[fd].recv_handler) {
+            auto handler = evmap[fd].recv_handler;
+            handler(has_buf ? bufs.get() + bid * BUF_SIZE : nullptr, c.res);
+        }
+        if (has_buf) give_back_buf(bid);
+        break;
+    case Send: {
+        auto handler = std::move(o->send_handler);
+        if (evmap[fd].send_op == index) evmap[fd].send_op = -1;
+        free_op(index);
+        handler(c.res);
+        return;
+    }
+    }
+    // The multishot operation is terminated.
+    if (!(c.flags & IORING_CQE_F_MORE)) {
+        if (evmap[fd].read_op == index) {
+            evmap[fd].read_op = -1;
+            rearm_fds.push_back(fd);
+        }
+        free_op(index);
+    }
+}
+
+int io_uring_base_t::submit_and_wait(unsigned wait_nr, int64_t timeout)
+{
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = nullptr;
+    size_t argsz = 0;
+
+    if (wait_nr > 0) {
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout >= 0) {
+            ts.tv_sec  = timeout / 1000;
+            ts.tv_nsec = timeout % 1000 * 1000000;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, argp, argsz);
+    if (ret >= 0) {
+        to_submit -= std::min<unsigned>(ret, to_submit);
+    }
+    return ret;
+}
+
+static int evret(int events)
+{
+    int revs = 0;
+    if (events & POLLIN) revs |= Read;
+    if (events & POLLOUT) revs |= Write;
+    if (events & POLLERR) revs |= Error;
+    return revs;
+}
+
+int io_uring_base_t::wait(evloop *loop, int64_t timeout)
+{
+    for (int fd : rearm_fds) {
+        rearm(fd);
+    }
+    rearm_fds.clear();
+
+    unsigned head = *cq_head;
+    bool ready = head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    unsigned wait_nr = (ready || timeout == 0) ? 0 : 1;
+
+    if (to_submit > 0 || wait_nr > 0) {
+        // Submit all changes and sends, and wait for events by one syscall.
+        if (submit_and_wait(wait_nr, timeout) < 0) {
+            if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+                log_error("io_uring_enter: %s", strerrno());
+                return -1;
+            }
+        }
+    }
+
+    int nevents = 0;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++) {
+        auto *cqe = &cqes[head & *cq_mask];
+        if (cqe->user_data == POLL_REMOVE_DATA || cqe->user_data == CANCEL_DATA) continue;
+        if (cqe->user_data & OP_DATA) {
+            completions.push_back({ cqe->user_data, cqe->res, cqe->flags });
+            continue;
+        }
+        int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+        uint32_t gen = cqe->user_data >> 32;
+        auto& st = evmap[fd];
+        // A stale or canceled poll request.
+        if (!st.armed || (st.gen & SEQ_MASK) != gen) continue;
+        st.armed = false;
+        rearm_fds.push_back(fd);
+        if (cqe->res == -ECANCELED) continue;
+        auto chl = loop->search_channel(fd);
+        chl->trigger = cqe->res < 0 ? Error : evret(cqe->res);
+        loop->active_channels.emplace_back(chl);
+        nevents++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    for (auto& c : completions) {
+        complete(c);
+    }
+    completions.clear();
+    return nevents;
+}
+
+}
+
+#endif
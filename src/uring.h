@@ -0,0 +1,186 @@
+#ifndef _ANGEL_URING_H
+#define _ANGEL_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <functional>
+#include <memory>
+
+#include "dispatcher.h"
+
+namespace angel {
+
+class evloop;
+
+// I/O multiplexing based on linux io_uring (IORING_OP_POLL_ADD).
+//
+// Every add() and remove() only fill a sqe, all of them will be submitted
+// together with waiting for completions by one io_uring_enter() in wait(),
+// so we don't need an epoll_ctl() for every change of events.
+//
+// The poll requests are one-shot, and will be rearmed at next wait(),
+// which keeps the level-triggered semantics of other dispatchers.
+//
+// It's also completion-based if the kernel supports it:
+// The Read event of a listening fd with an accept handler (linux 5.19),
+// or a socket with a recv handler (linux 6.0), is served by a multishot
+// accept or recv instead of a poll request, one sqe keeps completing with
+// the accepted fds or the received data, so neither a readiness event nor
+// an accept(2) or read(2) is needed for each of them.
+// The data is received into a ring of buffers provided to the kernel,
+// which is shared by all fds, and a buffer is given back to the ring as
+// soon as the recv handler returns.
+//
+// send() fills a sqe too, so all sends of a loop iteration are submitted
+// by the io_uring_enter() in wait().
+class io_uring_base_t : public dispatcher {
+public:
+    // Called with the accepted fd (non-blocking), or -errno.
+    typedef std::function<void(int)> accept_handler_t;
+    // Called with the received data, n == 0 means EOF, and n < 0 is -errno.
+    typedef std::function<void(const char *, ssize_t)> recv_handler_t;
+    // Called with the number of bytes sent, or -errno.
+    typedef std::function<void(ssize_t)> send_handler_t;
+
+    io_uring_base_t();
+    ~io_uring_base_t();
+    io_uring_base_t(const io_uring_base_t&) = delete;
+    io_uring_base_t& operator=(const io_uring_base_t&) = delete;
+
+    // The kernel may not support io_uring (or it is disabled),
+    // then we should fallback to other dispatchers.
+    bool is_supported() const { return ring_fd >= 0; }
+    // Can send() be used ?
+    bool has_send() const { return send_supported; }
+
+    int wait(evloop *loop, int64_t timeout) override;
+    void add(int fd, int events) override;
+    void remove(int fd, int events) override;
+
+    // The following member functions must be called in the loop thread.
+
+    // Serve the Read event of fd by a multishot accept or recv,
+    // it's ignored if the kernel doesn't support it, and fd is still polled.
+    // (The handler is also dropped if the first completion shows that,
+    // so the read handler of the channel should be kept.)
+    // The handler is kept until release(fd), even if the Read event
+    // is disabled, and the data received before that is still passed to it.
+    void set_accept_handler(int fd, accept_handler_t handler);
+    void set_recv_handler(int fd, recv_handler_t handler);
+    // Send iov[0, iovcnt) to fd if has_send(), at most one send per fd can be in flight.
+    // The memory referenced by iov must be valid until the handler is called,
+    // which is called exactly once, even if fd is released before that.
+    void send(int fd, const struct iovec *iov, int iovcnt, send_handler_t handler);
+    // Drop the handlers of fd, and cancel the operations in flight,
+    // it must be called before fd is closed.
+    void release(int fd);
+private:
+    struct fd_state {
+        int filter = 0;
+        // Distinguish completions of stale poll requests for the same fd.
+        uint32_t gen = 0;
+        // Is there a pending poll request ?
+        bool armed = false;
+        // Incremented by release(), the completions of the operations
+        // started before that are not passed to the new handlers.
+        uint32_t epoch = 0;
+        accept_handler_t accept_handler;
+        recv_handler_t recv_handler;
+        // Index of the multishot accept or recv serving the Read event.
+        int read_op = -1;
+        // Index of the send in flight.
+        int send_op = -1;
+    };
+
+    enum op_type { Accept, Recv, Send };
+
+    // A completion-based operation, indexed by its user_data.
+    struct op {
+        op_type type;
+        int fd;
+        // Incremented every time it's reused.
+        uint32_t seq = 0;
+        uint32_t epoch;
+        send_handler_t send_handler;
+        struct msghdr msg;
+        struct iovec iov[64];
+    };
+
+    // A copy of the cqe of an operation.
+    struct completion {
+        uint64_t user_data;
+        int32_t res;
+        uint32_t flags;
+    };
+
+    bool setup(unsigned entries);
+    // Indexed by the opcodes, true if it's supported.
+    std::vector<bool> probe_ops();
+    bool setup_buf_ring();
+    struct io_uring_sqe *get_sqe();
+    void poll_add(int fd);
+    void poll_remove(int fd);
+    // Events served by the poll request.
+    int poll_events(const fd_state& st) const;
+    // Is the Read event served by the multishot operation ?
+    bool is_completion_read(const fd_state& st) const;
+    // Start or stop the poll request and the multishot operation
+    // after the events or the handlers of fd have been changed.
+    void update(int fd, int old_poll_events);
+    void rearm(int fd);
+    void start_read(int fd);
+    int alloc_op(op_type type, int fd);
+    void free_op(int index);
+    uint64_t op_data(int index) const;
+    void cancel_op(int index);
+    void complete(const completion& c);
+    // Fall back to the poll requests for the Read events
+    // served by the multishot operations of type.
+    void disable_multishot(op_type type);
+    void give_back_buf(unsigned bid);
+    int submit_and_wait(unsigned wait_nr, int64_t timeout);
+
+    int ring_fd = -1;
+    unsigned sq_entries = 0;
+    unsigned cq_entries = 0;
+    // Number of sqes filled but not submitted.
+    unsigned to_submit = 0;
+    void *sq_ptr = nullptr;
+    size_t sq_size = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    bool multishot_accept = false;
+    bool multishot_recv = false;
+    bool send_supported = false;
+    // The provided buffer ring
+    struct io_uring_buf_ring *buf_ring = nullptr;
+    size_t buf_ring_size = 0;
+    std::unique_ptr<char[]> bufs;
+    uint16_t buf_tail = 0;
+
+    std::vector<fd_state> evmap;
+    // Fds whose poll request or multishot operation has been completed
+    // and need to be rearmed.
+    std::vector<int> rearm_fds;
+    std::vector<std::unique_ptr<op>> ops;
+    std::vector<int> free_ops;
+    // The completions of operations are handled after the cq is consumed,
+    // since the handlers may submit new sqes.
+    std::vector<completion> completions;
+};
+
+}
+
+#endif // _ANGEL_URING_H
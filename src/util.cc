@@ -8,6 +8,10 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#endif
+
 #include <sstream>
 
 #include <angel/logger.h>
@@ -183,15 +187,13 @@ end:
 bool is_regular_file(const std::string& path)
 {
     struct stat st;
-    ::stat(path.c_str(), &st);
-    return S_ISREG(st.st_mode);
+    return ::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
 }
 
 bool is_directory(const std::string& path)
 {
     struct stat st;
-    ::stat(path.c_str(), &st);
-    return S_ISDIR(st.st_mode);
+    return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
 }
 
 off_t get_file_size(const std::string& path)
@@ -249,6 +251,90 @@ void daemon()
         close(fd);
 }
 
+// The vectorized versions compare the bytes at p and p + 1 with '\r' and '\n'
+// at the same time, so a CRLF across two blocks is not missed.
+#if defined (__x86_64__) || defined (__i386__)
+
+__attribute__((target("sse2")))
+static inline int crlf_mask_sse2(const char *p)
+{
+    __m128i b1 = _mm_loadu_si128((const __m128i *)p);
+    __m128i b2 = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(b1, _mm_set1_epi8('\r')),
+                               _mm_cmpeq_epi8(b2, _mm_set1_epi8('\n')));
+    return _mm_movemask_epi8(eq);
+}
+
+// Less than 33 bytes are left, the last block overlaps the first one.
+__attribute__((target("sse2")))
+static const char *find_crlf_tail_sse2(const char *first, const char *last)
+{
+    if (last - first >= 17) {
+        int mask = crlf_mask_sse2(first);
+        if (mask) return first + __builtin_ctz(mask);
+        first = last - 17;
+        mask = crlf_mask_sse2(first);
+        return mask ? first + __builtin_ctz(mask) : last;
+    }
+    for ( ; last - first >= 2; first++) {
+        if (first[0] == '\r' && first[1] == '\n') return first;
+    }
+    return last;
+}
+
+__attribute__((target("sse2")))
+static const char *find_crlf_sse2(const char *first, const char *last)
+{
+    for ( ; last - first >= 33; first += 16) {
+        int mask = crlf_mask_sse2(first);
+        if (mask) return first + __builtin_ctz(mask);
+    }
+    return find_crlf_tail_sse2(first, last);
+}
+
+__attribute__((target("avx2")))
+static const char *find_crlf_avx2(const char *first, const char *last)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    for ( ; last - first >= 33; first += 32) {
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)first);
+        __m256i b2 = _mm256_loadu_si256((const __m256i *)(first + 1));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(b1, cr), _mm256_cmpeq_epi8(b2, lf));
+        unsigned mask = _mm256_movemask_epi8(eq);
+        if (mask) return first + __builtin_ctz(mask);
+    }
+    return find_crlf_tail_sse2(first, last);
+}
+
+typedef const char *(*find_crlf_fn)(const char *, const char *);
+
+static find_crlf_fn select_find_crlf()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? find_crlf_avx2 : find_crlf_sse2;
+}
+
+const char *find_crlf(const char *first, const char *last)
+{
+    static const find_crlf_fn impl = select_find_crlf();
+    return impl(first, last);
+}
+
+#else
+
+const char *find_crlf(const char *first, const char *last)
+{
+    while ((first = (const char *)memchr(first, '\r', last - first))) {
+        if (first + 1 == last) break;
+        if (first[1] == '\n') return first;
+        first++;
+    }
+    return last;
+}
+
+#endif
+
 static thread_local char format_send_buf[65536];
 
 format_result format(const char *fmt, va_list ap)
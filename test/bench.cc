@@ -9,13 +9,22 @@
 
 #include <unistd.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#if defined (__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
 
 #include <iostream>
+#include <thread>
+#include <atomic>
 
 static int num_pipes, num_active, num_writes;
 static int writes, count, failures, fired;
 static std::vector<int> pipes;
 static angel::evloop *g_loop = nullptr;
+static angel::evloop_options loop_ops;
+static bool edge_triggered = false;
 
 static void read_cb(int fd, int idx)
 {
@@ -45,11 +54,12 @@ static void read_cb(int fd, int idx)
 
 int64_t run_once()
 {
-    angel::evloop loop;
+    angel::evloop loop(loop_ops);
     g_loop = &loop;
 
     for (int i = 0; i < num_pipes * 2; i += 2) {
         auto chl = new angel::channel(&loop, pipes[i], false);
+        chl->set_edge_triggered(edge_triggered);
         chl->set_read_handler([fd = pipes[i], idx = i]{ read_cb(fd, idx); });
         chl->add();
     }
@@ -69,13 +79,143 @@ int64_t run_once()
     return t2 - t1;
 }
 
+#if defined (__linux__)
+static long epoll_ctl_calls = 0;
+
+// Count the epoll_ctl(2) made by the dispatcher.
+extern "C" int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    epoll_ctl_calls++;
+    return syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+#endif
+
+// Send a message of msg_size bytes on each pair in turn, which is larger
+// than the socket buffers, so every send is a partial write followed by
+// enable_write() and disable_write() when the rest has been written.
+// In level-triggered mode, both of them are an epoll_ctl(2),
+// in edge-triggered mode, they only update the filter of the channel.
+static int msg_size = 0;
+
+struct write_pair {
+    angel::channel *reader;
+    angel::channel *writer;
+    size_t written;
+    size_t received;
+};
+
+static std::vector<write_pair> write_pairs;
+static std::string msg;
+static int rounds, finished;
+
+static void write_msg(write_pair& wp)
+{
+    while (wp.written < msg.size()) {
+        ssize_t n = write(wp.writer->fd(), msg.data() + wp.written, msg.size() - wp.written);
+        if (n < 0) {
+            if (errno != EAGAIN) failures++;
+            break;
+        }
+        wp.written += n;
+    }
+    if (wp.written < msg.size()) wp.writer->enable_write();
+    else wp.writer->disable_write();
+}
+
+static void read_msg(write_pair& wp)
+{
+    char buf[65536];
+    ssize_t n;
+    // Read until EAGAIN for edge-triggered mode.
+    while ((n = read(wp.reader->fd(), buf, sizeof(buf))) > 0) {
+        wp.received += n;
+    }
+    if (n < 0 && errno != EAGAIN) failures++;
+    if (wp.received < msg.size()) return;
+    wp.written = wp.received = 0;
+    if (rounds > 0) {
+        rounds--;
+        write_msg(wp);
+    } else if (++finished == num_active) {
+        g_loop->quit();
+    }
+}
+
+int64_t run_write_once()
+{
+    angel::evloop loop(loop_ops);
+    g_loop = &loop;
+
+    write_pairs.resize(num_pipes);
+    for (int i = 0; i < num_pipes; i++) {
+        auto& wp = write_pairs[i];
+        wp.reader = new angel::channel(&loop, pipes[2 * i], false);
+        wp.writer = new angel::channel(&loop, pipes[2 * i + 1], false);
+        wp.written = wp.received = 0;
+        wp.reader->set_edge_triggered(edge_triggered);
+        wp.writer->set_edge_triggered(edge_triggered);
+        wp.reader->set_read_handler([&wp]{ read_msg(wp); });
+        wp.writer->set_write_handler([&wp]{ write_msg(wp); });
+        wp.reader->add();
+        wp.writer->add();
+        // The writer doesn't read.
+        wp.writer->disable_read();
+    }
+
+    rounds = num_writes;
+    finished = 0;
+    int space = num_pipes / num_active;
+#if defined (__linux__)
+    epoll_ctl_calls = 0;
+#endif
+    auto t1 = angel::util::get_cur_time_us();
+    for (int i = 0; i < num_active; i++) {
+        write_msg(write_pairs[i * space]);
+    }
+    loop.run();
+    auto t2 = angel::util::get_cur_time_us();
+    return t2 - t1;
+}
+
+// Submit tasks to the loop from other threads by queue_in_loop().
+static int num_producers, num_tasks;
+
+int64_t run_queue_once()
+{
+    angel::evloop loop(loop_ops);
+    std::atomic_bool start(false);
+    int executed = 0;
+    int total = num_producers * num_tasks;
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < num_producers; i++) {
+        producers.emplace_back([&]{
+                while (!start) std::this_thread::yield();
+                for (int j = 0; j < num_tasks; j++) {
+                    loop.queue_in_loop([&]{
+                        if (++executed == total) loop.quit();
+                    });
+                }
+        });
+    }
+
+    auto t1 = angel::util::get_cur_time_us();
+    start = true;
+    loop.run();
+    auto t2 = angel::util::get_cur_time_us();
+    for (auto& t : producers) t.join();
+    return t2 - t1;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
     num_pipes   = 100;
     num_active  = 1;
     num_writes  = num_pipes;
-    while ((c = getopt(argc, argv, "n:a:w:")) != -1) {
+    num_producers = 0;
+    num_tasks   = 100000;
+    while ((c = getopt(argc, argv, "n:a:w:p:q:uem:")) != -1) {
         switch (c) {
         case 'n':
             num_pipes = atoi(optarg);
@@ -86,12 +226,39 @@ int main(int argc, char *argv[])
         case 'w':
             num_writes = atoi(optarg);
             break;
+        case 'p':
+            num_producers = atoi(optarg);
+            break;
+        case 'q':
+            num_tasks = atoi(optarg);
+            break;
+        case 'u':
+            loop_ops.use_io_uring = true;
+            break;
+        case 'e':
+            edge_triggered = true;
+            break;
+        case 'm':
+            msg_size = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
             exit(1);
         }
     }
 
+    if (num_producers > 0) {
+        long total = 0;
+        for (int i = 0; i < 25; i++) {
+            long cost = run_queue_once();
+            std::cout << cost << '\n';
+            total += cost;
+        }
+        std::cout << total / 25 << " (average), "
+                  << total * 1000.0 / 25 / (num_producers * num_tasks) << " ns/task\n";
+        exit(0);
+    }
+
     struct rlimit rl;
     rl.rlim_cur = rl.rlim_max = num_pipes * 2 + 100;
     if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
@@ -104,13 +271,41 @@ int main(int argc, char *argv[])
         angel::sockops::socketpair(&pipes[i]);
     }
 
+    if (msg_size > 0) {
+        msg.assign(msg_size, 'e');
+        for (int i = 0; i < num_pipes * 2; i++) {
+            int size = 4096;
+            setsockopt(pipes[i], SOL_SOCKET, i % 2 ? SO_SNDBUF : SO_RCVBUF, &size, sizeof(size));
+            angel::sockops::set_nonblock(pipes[i]);
+        }
+        long total = 0, ctls = 0;
+        for (int i = 0; i < 25; i++) {
+            long cost = run_write_once();
+            std::cout << cost << '\n';
+            total += cost;
+#if defined (__linux__)
+            ctls += epoll_ctl_calls;
+#endif
+        }
+        int msgs = num_writes + num_active;
+        std::cout << total / 25 << " (average), "
+                  << total * 1000.0 / 25 / msgs << " ns/msg, "
+                  << (double)ctls / 25 / msgs << " epoll_ctl/msg ("
+                  << (edge_triggered ? "edge" : "level") << "-triggered)\n";
+        if (failures > 0) std::cout << failures << " failures\n";
+        exit(0);
+    }
+
+    // Every write fires a read event, so the cost per event is mostly
+    // the cost of dispatching it (lookup channel by fd, invoke handler).
     long total = 0;
     for (int i = 0; i < 25; i++) {
         long cost = run_once();
         std::cout << cost << '\n';
         total += cost;
     }
-    std::cout << total / 25 << " (average)\n";
+    std::cout << total / 25 << " (average), "
+              << total * 1000.0 / 25 / (num_writes + num_active) << " ns/event\n";
 
     exit(0);
 }
@@ -1,6 +1,15 @@
 #include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <thread>
+#include <future>
+#include <fstream>
+#include <sstream>
 
 #include <angel/client.h>
+#include <angel/httplib.h>
 #include <angel/util.h>
 #include <angel/resolver.h>
 #include <angel/config.h>
@@ -15,8 +24,95 @@ static int timelimit    = 60 * 1000;
 static int timeout      = 15 * 1000;
 static int max_timeouts = 10;
 
+static bool local     = false;
+static bool cork      = false;
+static int body_size  = 8192;
+static int pipeline_depth = 0;
+
 static int send_requests = 0, completions = 0, failures = 0, timeouts = 0;
-static long long total_bytes = 0, total_latency = 0;
+static long long total_bytes = 0, total_latency = 0, total_reads = 0;
+
+// The number of read or write syscalls (key is "syscr:" or "syscw:")
+// made by the calling thread.
+// The operations completed by io_uring are not counted.
+static long long thread_syscalls(const std::string& name)
+{
+    std::ifstream io("/proc/thread-self/io");
+    std::string key;
+    long long value;
+    while (io >> key >> value) {
+        if (key == name) return value;
+    }
+    return -1;
+}
+
+// The CPU time (us) consumed by the calling thread.
+static long long thread_cpu_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+// The number of TCP segments sent by the system.
+static long long tcp_out_segs()
+{
+    std::ifstream snmp("/proc/net/snmp");
+    std::string names, values;
+    while (std::getline(snmp, names) && std::getline(snmp, values)) {
+        if (names.compare(0, 4, "Tcp:") != 0) continue;
+        std::istringstream ns(names), vs(values);
+        std::string name, value;
+        while (ns >> name && vs >> value) {
+            if (name == "OutSegs") return std::stoll(value);
+        }
+    }
+    return -1;
+}
+
+// An http_server running in another thread, responding every request
+// with a body of body_size bytes, which is sent by a header write and
+// a body write (unless corked).
+// It uses the same dispatcher as the client, so that epoll and io_uring
+// can be compared by the syscalls and CPU time of the server thread.
+struct local_server {
+    angel::evloop *loop = nullptr;
+    std::thread thread;
+    long long read_syscalls = 0;
+    long long write_syscalls = 0;
+    long long cpu_time = 0;
+
+    void start(int port, const std::string& path, angel::evloop_options ops)
+    {
+        std::promise<void> started;
+        thread = std::thread([this, port, path, ops, &started]{
+                angel::evloop loop(ops);
+                angel::httplib::http_server server(&loop, angel::inet_addr(port));
+                std::string body(body_size, 'x');
+                server.set_cork(cork);
+                server.Get(path, [&body](angel::httplib::request& req, angel::httplib::response& res){
+                        res.set_status_code(angel::httplib::Ok);
+                        res.set_content(body);
+                        });
+                server.start();
+                this->loop = &loop;
+                started.set_value();
+                auto r = thread_syscalls("syscr:");
+                auto w = thread_syscalls("syscw:");
+                auto t = thread_cpu_time();
+                loop.run();
+                read_syscalls = thread_syscalls("syscr:") - r;
+                write_syscalls = thread_syscalls("syscw:") - w;
+                cpu_time = thread_cpu_time() - t;
+                });
+        started.get_future().wait();
+    }
+    void stop()
+    {
+        loop->quit();
+        thread.join();
+    }
+};
 
 struct request_info {
     std::unique_ptr<angel::client> cli;
@@ -25,9 +121,33 @@ struct request_info {
     int idx = 0;
 };
 
+// In pipelined mode, each connection sends pipeline_depth requests at once,
+// and sends the next batch after all responses of the last one are received.
+struct pipeline_info {
+    std::unique_ptr<angel::client> cli;
+    long long start; // batch start time
+    int pending = 0; // responses to receive of the current batch
+};
+
+// Return the size of the first complete response in buf, or 0 if it is not.
+// Only Content-Length is supported.
+static size_t response_size(angel::buffer& buf)
+{
+    std::string_view s(buf.peek(), buf.readable());
+    size_t head = s.find("\r\n\r\n");
+    if (head == std::string_view::npos) return 0;
+    head += 4;
+    size_t len = 0;
+    size_t pos = s.substr(0, head).find("Content-Length: ");
+    if (pos != std::string_view::npos) len = atol(s.data() + pos + 16);
+    return s.size() >= head + len ? head + len : 0;
+}
+
 struct bench_http {
     angel::evloop *loop;
     std::unordered_map<int, std::unique_ptr<request_info>> requests;
+    std::vector<std::unique_ptr<pipeline_info>> pipelines;
+    std::string batch;
     std::string scheme, host, ip, path;
     int port;
 
@@ -37,6 +157,16 @@ struct bench_http {
 private:
     void launch_request();
     void close_handler(request_info *ri);
+    void launch_pipeline();
+    void send_batch(const angel::connection_ptr& conn, pipeline_info *pi);
+    void pipeline_failed(pipeline_info *pi);
+
+    void count_completion()
+    {
+        completions++;
+        if ((num_requests / 10) && completions % (num_requests / 10) == 0)
+            printf("Completed %d requests\n", completions);
+    }
 
     void check_finish()
     {
@@ -91,6 +221,7 @@ void bench_http::launch_request()
     ri->cli->set_message_handler([](const angel::connection_ptr& conn, angel::buffer& buf){
             // We don't parse http response.
             total_bytes += buf.readable();
+            total_reads++;
             buf.retrieve_all();
             });
     ri->cli->set_close_handler([this, ri](const angel::connection_ptr& conn){
@@ -103,14 +234,78 @@ void bench_http::launch_request()
 void bench_http::close_handler(request_info *ri)
 {
     loop->cancel_timer(ri->timeout_timer_id);
-    completions++;
     total_latency += angel::util::get_cur_time_us() - ri->start;
-    if ((num_requests / 10) && completions % (num_requests / 10) == 0)
-        printf("Completed %d requests\n", completions);
+    count_completion();
     requests.erase(ri->idx);
     check_finish();
 }
 
+void bench_http::launch_pipeline()
+{
+    auto *pi = new pipeline_info();
+    pipelines.emplace_back(pi);
+
+#if defined (ANGEL_USE_OPENSSL)
+    if (scheme == "https") {
+        pi->cli.reset(new angel::ssl_client(loop, angel::inet_addr(ip, port)));
+    } else {
+        pi->cli.reset(new angel::client(loop, angel::inet_addr(ip, port)));
+    }
+#else
+    pi->cli.reset(new angel::client(loop, angel::inet_addr(ip, port)));
+#endif
+    pi->cli->set_connection_handler([this, pi](const angel::connection_ptr& conn){
+            send_batch(conn, pi);
+            });
+    pi->cli->set_connection_failure_handler([this, pi]{
+            pipeline_failed(pi);
+            });
+    pi->cli->set_message_handler([this, pi](const angel::connection_ptr& conn, angel::buffer& buf){
+            total_reads++;
+            while (size_t n = response_size(buf)) {
+                total_bytes += n;
+                buf.retrieve(n);
+                total_latency += angel::util::get_cur_time_us() - pi->start;
+                count_completion();
+                if (--pi->pending > 0) continue;
+                if (completions + failures == num_requests) {
+                    loop->quit();
+                } else if (send_requests < num_requests) {
+                    send_batch(conn, pi);
+                }
+            }
+            });
+    pi->cli->set_close_handler([this, pi](const angel::connection_ptr& conn){
+            pipeline_failed(pi);
+            });
+    pi->cli->start();
+}
+
+// Send the next batch of requests in one write.
+void bench_http::send_batch(const angel::connection_ptr& conn, pipeline_info *pi)
+{
+    int n = std::min(pipeline_depth, num_requests - send_requests);
+    if (n <= 0) return;
+    conn->send(batch.data(), batch.size() / pipeline_depth * n);
+    send_requests += n;
+    pi->pending = n;
+    pi->start = angel::util::get_cur_time_us();
+}
+
+// The requests of the current batch are lost, and no more are sent on it.
+void bench_http::pipeline_failed(pipeline_info *pi)
+{
+    if (pi->pending == 0 && send_requests < num_requests) {
+        pi->pending = std::min(pipeline_depth, num_requests - send_requests);
+        send_requests += pi->pending;
+    }
+    failures += pi->pending;
+    pi->pending = 0;
+    if (completions + failures == num_requests) {
+        loop->quit();
+    }
+}
+
 bool bench_http::parse_url(std::string_view url)
 {
     const char *p = url.data();
@@ -148,6 +343,11 @@ bool bench_http::parse_url(std::string_view url)
 
 bool bench_http::resolve()
 {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, host.c_str(), &addr) == 1) {
+        ip = host;
+        return true;
+    }
     auto *resolver = angel::dns::resolver::get_resolver();
     auto res = resolver->get_addr_list(host, 5000);
     if (res.empty()) return false;
@@ -165,8 +365,17 @@ long bench_http::bench()
     auto t1 = angel::util::get_cur_time_ms();
 
     concurrency = std::min(concurrency, num_requests);
-    for (int i = 0; i < concurrency; i++) {
-        launch_request();
+    if (pipeline_depth > 0) {
+        for (int i = 0; i < pipeline_depth; i++) {
+            batch.append("GET ").append(path).append(" HTTP/1.1\r\nHost: ").append(host).append("\r\n\r\n");
+        }
+        for (int i = 0; i < concurrency; i++) {
+            launch_pipeline();
+        }
+    } else {
+        for (int i = 0; i < concurrency; i++) {
+            launch_request();
+        }
     }
     loop->run();
 
@@ -183,6 +392,12 @@ static void usage()
             "    -t <timelimit>   Seconds to max. to spend on benchmarking. Default is 60 secs.\n"
             "    -s <timeout>     Seconds to max. wait for each response. Default is 15 secs.\n"
             "    -S <number>      Maximum number of timeout requests. Default is 10.\n"
+            "    -u               Use io_uring as the I/O multiplexing (also for the local server).\n"
+            "    -l               Run a local http server in another thread to serve the URL.\n"
+            "    -C               Cork the connections of the local server.\n"
+            "    -b <bytes>       Size of the response body of the local server. Default is 8192.\n"
+            "    -p <depth>       Pipeline <depth> requests at a time on each of the <concurrency>\n"
+            "                     keep-alive connections (e.g. 16), -s and -S are not used.\n"
            );
     exit(1);
 }
@@ -190,7 +405,8 @@ static void usage()
 int main(int argc, char *argv[])
 {
     int c;
-    while ((c = getopt(argc, argv, "c:n:t:s:S:")) != -1) {
+    angel::evloop_options ops;
+    while ((c = getopt(argc, argv, "c:n:t:s:S:ulCb:p:")) != -1) {
         switch (c) {
         case 'c':
             concurrency = atoi(optarg);
@@ -207,6 +423,21 @@ int main(int argc, char *argv[])
         case 'S':
             max_timeouts = atoi(optarg);
             break;
+        case 'u':
+            ops.use_io_uring = true;
+            break;
+        case 'l':
+            local = true;
+            break;
+        case 'C':
+            local = cork = true;
+            break;
+        case 'b':
+            body_size = atoi(optarg);
+            break;
+        case 'p':
+            pipeline_depth = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
             usage();
@@ -216,7 +447,14 @@ int main(int argc, char *argv[])
         usage();
     }
 
-    angel::evloop loop;
+    // Both ends of 10k+ connections are in this process with -l.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    angel::evloop loop(ops);
 
     bench_http bench;
     bench.loop = &loop;
@@ -231,10 +469,17 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    local_server server;
+    if (local) server.start(bench.port, bench.path, ops);
+    auto out_segs = tcp_out_segs();
+
     printf("Benchmarking...\n");
 
     auto total_cost = bench.bench();
 
+    out_segs = tcp_out_segs() - out_segs;
+    if (local) server.stop();
+
     auto total_secs = (double)total_cost / 1000;
     auto total_latency_ms = (double)total_latency / 1000;
 
@@ -244,5 +489,20 @@ int main(int argc, char *argv[])
             completions, failures, timeouts, total_secs);
     printf("Throughput: %lld (bytes/sec)\n", (long long)(total_bytes / total_secs));
     printf("Requests per second: %.2f (#/sec)\n", completions / total_secs);
+    if (pipeline_depth > 0) {
+        printf("Pipeline depth: %d\n", pipeline_depth);
+    }
     printf("Latency per request: %.2f (ms)\n", total_latency_ms / completions);
+    printf("Reads per response: %.2f\n", (double)total_reads / completions);
+    // Including the segments sent by the client and other processes.
+    printf("TCP segments sent per request: %.2f\n", (double)out_segs / completions);
+    if (local) {
+        printf("Server dispatcher: %s\n", ops.use_io_uring ? "io_uring" : "default");
+        printf("Server read syscalls per request: %.2f\n",
+               (double)server.read_syscalls / completions);
+        printf("Server write syscalls per request: %.2f (cork %s)\n",
+               (double)server.write_syscalls / completions, cork ? "on" : "off");
+        printf("Server CPU time per request: %.2f (us)\n",
+               (double)server.cpu_time / completions);
+    }
 }
@@ -0,0 +1,200 @@
+//
+// Measure the cost of parsing a typical request head.
+//
+// in-place: request::parse_head(), the header fields are views
+//           pointing into the buffer, then a few header() lookups.
+// copy:     the old way, split the request line, decode the path,
+//           parse the query into Params and copy every header field
+//           into Headers by message::parse_header().
+//
+// With -r the head arrives in reads of the given size, parse_head()
+// resumes the scan where the last call stopped (resume), compared with
+// parsing it from the beginning every time (restart).
+//
+// The raw CRLF scan (util::find_crlf()) is also compared with std::search.
+//
+
+#include <angel/httplib.h>
+#include <angel/util.h>
+
+#include <unistd.h>
+#include <string.h>
+
+#include <iostream>
+#include <algorithm>
+
+using namespace angel::httplib;
+
+// The parsing functions of request are private to http_server.
+namespace angel {
+namespace httplib {
+struct request_test {
+    static StatusCode parse_head(request& req, buffer& buf) { return req.parse_head(buf); }
+    static size_t head_size(const request& req) { return req.head_size(); }
+    static void clear(request& req) { req.clear(); }
+};
+}
+}
+
+static int num_requests = 1000000;
+static size_t read_size = 16;
+
+static const char *request_head =
+    "GET /index.html?user=angel&lang=en%2Dus HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "If-None-Match: \"64a2b7c1-1f4\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static double per_op(int64_t cost_us, int ops)
+{
+    return ops > 0 ? (double)cost_us * 1000 / ops : 0;
+}
+
+static size_t parse_in_place(angel::buffer& buf)
+{
+    request req;
+    size_t n = 0;
+    for (int i = 0; i < num_requests; i++) {
+        buf.append(request_head);
+        if (request_test::parse_head(req, buf) != Ok) abort();
+        n += req.header("Host").size() + req.header("Connection").size() +
+             req.header("Range").size() + req.path().size();
+        buf.retrieve(request_test::head_size(req));
+        request_test::clear(req);
+    }
+    return n;
+}
+
+static size_t parse_in_reads(angel::buffer& buf, bool resume)
+{
+    request req;
+    size_t n = 0;
+    size_t len = strlen(request_head);
+    for (int i = 0; i < num_requests / 10; i++) {
+        StatusCode code = Continue;
+        for (size_t off = 0; off < len; off += read_size) {
+            buf.append(request_head + off, std::min(read_size, len - off));
+            if (!resume) request_test::clear(req);
+            if ((code = request_test::parse_head(req, buf)) != Continue) break;
+        }
+        if (code != Ok) abort();
+        n += req.header("Host").size() + req.path().size();
+        buf.retrieve(request_test::head_size(req));
+        request_test::clear(req);
+    }
+    return n;
+}
+
+static double scan_gbps(bool vectorized)
+{
+    // A header block without the empty line, so every CRLF is found.
+    std::string text;
+    const char *p = strstr(request_head, "\r\n") + 2;
+    while (text.size() < 64 * 1024) text.append(p, strlen(p) - 2);
+    const char *first = text.data(), *last = first + text.size();
+    std::string_view crlf("\r\n");
+    size_t bytes = 0, lines = 0;
+    auto t1 = angel::util::get_cur_time_us();
+    for (int i = 0; i < 2000; i++) {
+        for (const char *s = first; s < last; lines++) {
+            const char *e = vectorized ? angel::util::find_crlf(s, last)
+                                       : std::search(s, last, crlf.begin(), crlf.end());
+            s = e + 2;
+        }
+        bytes += text.size();
+    }
+    auto t2 = angel::util::get_cur_time_us();
+    if (lines == 0) abort();
+    return bytes / ((t2 - t1) * 1e3);
+}
+
+static size_t parse_copy(angel::buffer& buf)
+{
+    message msg;
+    std::string path;
+    Params params;
+    size_t n = 0;
+    for (int i = 0; i < num_requests; i++) {
+        buf.append(request_head);
+        int crlf = buf.find_crlf();
+        auto res = angel::util::split({buf.peek(), (size_t)crlf}, ' ');
+        if (res.size() != 3) abort();
+        const char *p = res[1].data();
+        const char *end = p + res[1].size();
+        const char *sep = std::find(p, end, '?');
+        if (!uri::decode({p, (size_t)(sep - p)}, path)) abort();
+        if (sep != end && !uri::parse_params(sep + 1, end, params)) abort();
+        buf.retrieve(crlf + 2);
+        if (msg.parse_header(buf) != Ok) abort();
+        auto it = msg.headers.find("Host");
+        if (it != msg.headers.end()) n += it->second.size();
+        it = msg.headers.find("Connection");
+        if (it != msg.headers.end()) n += it->second.size();
+        it = msg.headers.find("Range");
+        if (it != msg.headers.end()) n += it->second.size();
+        n += path.size();
+        path.clear();
+        params.clear();
+        msg.clear();
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            num_requests = atoi(optarg);
+            break;
+        case 'r':
+            read_size = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            fprintf(stderr, "Usage: ./bench_http_parse [-n requests] [-r read size]\n");
+            exit(1);
+        }
+    }
+
+    if (read_size == 0) {
+        fprintf(stderr, "read size must be greater than 0\n");
+        exit(1);
+    }
+
+    printf("requests: %d, head size: %zu bytes\n", num_requests, strlen(request_head));
+
+    printf("crlf scan: std::search %.2f GB/s, util::find_crlf %.2f GB/s\n",
+           scan_gbps(false), scan_gbps(true));
+
+    angel::buffer buf;
+    auto t1 = angel::util::get_cur_time_us();
+    size_t n1 = parse_in_place(buf);
+    auto t2 = angel::util::get_cur_time_us();
+    size_t n2 = parse_copy(buf);
+    auto t3 = angel::util::get_cur_time_us();
+    if (n1 != n2) {
+        fprintf(stderr, "### Mismatch: %zu != %zu\n", n1, n2);
+        exit(1);
+    }
+
+    printf("in-place: %8.2f ns/request\n", per_op(t2 - t1, num_requests));
+    printf("copy:     %8.2f ns/request\n", per_op(t3 - t2, num_requests));
+
+    auto t4 = angel::util::get_cur_time_us();
+    n1 = parse_in_reads(buf, true);
+    auto t5 = angel::util::get_cur_time_us();
+    n2 = parse_in_reads(buf, false);
+    auto t6 = angel::util::get_cur_time_us();
+    if (n1 != n2) abort();
+    printf("%zu-byte reads, resume:  %8.2f ns/request\n", read_size, per_op(t5 - t4, num_requests / 10));
+    printf("%zu-byte reads, restart: %8.2f ns/request\n", read_size, per_op(t6 - t5, num_requests / 10));
+}
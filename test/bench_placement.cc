@@ -0,0 +1,145 @@
+//
+// Compare the placement policies of io loops under a skewed workload.
+//
+// Every <num_loops>th connection is heavy: it lives until the end,
+// and the server queues a large response that the client never reads.
+// The others are light: they are closed by the server immediately.
+//
+// So round-robin places all heavy connections in the same io loop.
+//
+
+#include <angel/server.h>
+#include <angel/sockops.h>
+#include <angel/signal.h>
+#include <angel/util.h>
+
+#include <unistd.h>
+
+#include <iostream>
+#include <future>
+#include <mutex>
+#include <map>
+
+static int num_loops    = 4;
+static int num_conns    = 64;
+static int heavy_size   = 8 * 1024 * 1024;
+static int port         = 18090;
+
+static void run_once(const char *name, angel::placement_policy policy)
+{
+    std::mutex mtx;
+    std::map<angel::evloop*, int> heavy_map; // heavy connections per loop
+    std::atomic_int heavy_done(0);
+    angel::evloop *main_loop = nullptr;
+    angel::server *server = nullptr;
+    std::promise<void> started;
+    std::string heavy_response(heavy_size, 'x');
+
+    std::thread server_thread([&]{
+            angel::evloop loop;
+            angel::server serv(&loop, angel::inet_addr(port));
+            serv.set_message_handler([&](const angel::connection_ptr& conn, angel::buffer& buf){
+                    if (buf.starts_with("H")) {
+                        conn->send(heavy_response);
+                        std::lock_guard<std::mutex> lk(mtx);
+                        heavy_map[conn->get_loop()]++;
+                        heavy_done++;
+                    } else {
+                        conn->close();
+                    }
+                    buf.retrieve_all();
+                    });
+            serv.start_io_threads(num_loops, angel::evloop_options(), policy);
+            serv.start();
+            main_loop = &loop;
+            server = &serv;
+            started.set_value();
+            loop.run();
+            });
+    started.get_future().wait();
+
+    std::vector<int> heavy_fds;
+    char c;
+    auto t1 = angel::util::get_cur_time_us();
+    for (int i = 0; i < num_conns; i++) {
+        angel::inet_addr addr("127.0.0.1", port);
+        int fd = angel::sockops::socket();
+        // Keep the heavy responses in the output buffer of the server.
+        int rcvbuf = 4096;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (angel::sockops::connect(fd, &addr.addr()) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        if (i % num_loops == 0) {
+            write(fd, "H", 1);
+            heavy_fds.push_back(fd);
+        } else {
+            write(fd, "L", 1);
+            // Wait until the server closes it.
+            while (read(fd, &c, 1) > 0) ;
+            close(fd);
+        }
+    }
+    while (heavy_done < (int)heavy_fds.size()) usleep(1000);
+    auto t2 = angel::util::get_cur_time_us();
+
+    int max_heavy = 0;
+    size_t max_conns = 0;
+    int64_t max_queued = 0;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto& [loop, heavy] : heavy_map) {
+            auto& load = loop->get_load();
+            max_heavy  = std::max(max_heavy, heavy);
+            max_conns  = std::max(max_conns, load.connections.load());
+            max_queued = std::max(max_queued, load.queued_bytes.load());
+        }
+    }
+    double avg = (double)heavy_fds.size() / num_loops;
+    printf("%-22s heavy per loop: max %4d (avg %6.1f, imbalance %.2fx), "
+           "max connections %4zu, max queued %7.2f MB, %6.2f us/conn\n",
+           name, max_heavy, avg, max_heavy / avg, max_conns,
+           max_queued / 1024.0 / 1024, (double)(t2 - t1) / num_conns);
+
+    for (int fd : heavy_fds) close(fd);
+    // All connections must be closed before the server is destroyed.
+    while (server->get_connection_nums() > 0) usleep(1000);
+    main_loop->quit();
+    server_thread.join();
+    port++;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "t:n:s:p:")) != -1) {
+        switch (c) {
+        case 't':
+            num_loops = atoi(optarg);
+            break;
+        case 'n':
+            num_conns = atoi(optarg);
+            break;
+        case 's':
+            heavy_size = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            exit(1);
+        }
+    }
+
+    // The clients never read the heavy responses.
+    angel::ignore_signal(SIGPIPE);
+
+    run_once("round_robin", angel::placement_policy::round_robin);
+    run_once("least_connections", angel::placement_policy::least_connections);
+    run_once("least_queued_bytes", angel::placement_policy::least_queued_bytes);
+    run_once("power_of_two_choices", angel::placement_policy::power_of_two_choices);
+
+    exit(0);
+}
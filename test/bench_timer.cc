@@ -0,0 +1,96 @@
+//
+// Compare the timer backends (set and wheel) under churn.
+//
+// Each connection holds an idle ttl timer, which is refreshed every time
+// a request arrives, this is what connection::update_ttl_timer() does.
+//
+
+#include <angel/evloop.h>
+#include <angel/util.h>
+
+#include <unistd.h>
+
+#include <iostream>
+#include <random>
+
+static int num_timers   = 200000;
+static int num_refresh  = 2000000;
+static int ttl          = 30 * 1000;
+
+static std::vector<size_t> ids;
+
+static double per_op(int64_t cost_us, int ops)
+{
+    return ops > 0 ? (double)cost_us * 1000 / ops : 0;
+}
+
+static void run_once(const char *name, angel::evloop_options ops)
+{
+    angel::evloop loop(ops);
+    std::mt19937 rng(0);
+    int fired = 0;
+
+    ids.resize(num_timers);
+
+    auto t1 = angel::util::get_cur_time_us();
+    for (int i = 0; i < num_timers; i++) {
+        ids[i] = loop.run_after(ttl + rng() % ttl, [&fired]{ fired++; });
+    }
+    auto t2 = angel::util::get_cur_time_us();
+    for (int i = 0; i < num_refresh; i++) {
+        loop.refresh_timer(ids[rng() % num_timers], ttl);
+    }
+    auto t3 = angel::util::get_cur_time_us();
+    // The old way to update ttl: cancel and add again.
+    for (int i = 0; i < num_refresh; i++) {
+        auto& id = ids[rng() % num_timers];
+        loop.cancel_timer(id);
+        id = loop.run_after(ttl, [&fired]{ fired++; });
+    }
+    auto t4 = angel::util::get_cur_time_us();
+    for (int i = 0; i < num_timers; i++) {
+        loop.cancel_timer(ids[i]);
+    }
+    auto t5 = angel::util::get_cur_time_us();
+
+    printf("%-6s add: %8.2f ns/op, refresh: %8.2f ns/op, "
+           "cancel+add: %8.2f ns/op, cancel: %8.2f ns/op\n", name,
+           per_op(t2 - t1, num_timers),
+           per_op(t3 - t2, num_refresh),
+           per_op(t4 - t3, num_refresh),
+           per_op(t5 - t4, num_timers));
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:r:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            num_timers = atoi(optarg);
+            break;
+        case 'r':
+            num_refresh = atoi(optarg);
+            break;
+        case 't':
+            ttl = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            fprintf(stderr, "Usage: ./bench_timer [-n timers] [-r refreshes] [-t ttl(ms)]\n");
+            exit(1);
+        }
+    }
+    if (num_timers <= 0 || ttl <= 0) {
+        fprintf(stderr, "timers and ttl must be greater than 0\n");
+        exit(1);
+    }
+
+    printf("timers: %d, refreshes: %d, ttl: %d ms\n", num_timers, num_refresh, ttl);
+
+    angel::evloop_options ops;
+    ops.timer = angel::evloop_options::timer_type::set;
+    run_once("set", ops);
+    ops.timer = angel::evloop_options::timer_type::wheel;
+    run_once("wheel", ops);
+}
@@ -0,0 +1,178 @@
+//
+// Measure the throughput of serving a static file over TLS,
+// with and without kTLS on the server side.
+//
+// Usage: ./bench_tls -C cert.pem -K key.pem [-c conns] [-s file size (MB)] [-n rounds] [-u]
+//
+// Without kTLS, ssl_connection::sendfile() has to mmap() the file and
+// encrypt it in user space by SSL_write(); with kTLS the file is sent by
+// sendfile(2) and the kernel encrypts the pages.
+//
+// With -u the clients upload the same amount of data instead,
+// which measures the decryption (ssl_filter) on the server side.
+//
+// kTLS needs the tls kernel module (modprobe tls) and OpenSSL 3.0+
+// built with enable-ktls, otherwise both runs take the same path.
+//
+
+#include <angel/ssl_server.h>
+#include <angel/ssl_client.h>
+#include <angel/util.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <future>
+#include <vector>
+
+static std::string cert_file;
+static std::string key_file;
+static int num_conns     = 4;
+static size_t file_size  = 64 * 1024 * 1024;
+static int rounds        = 4;
+static int port          = 18200;
+static bool upload       = false;
+
+static void send_chunk(const angel::connection_ptr& conn, size_t *sent,
+                       const std::shared_ptr<std::string>& chunk)
+{
+    if (*sent >= file_size * rounds) return;
+    *sent += chunk->size();
+    conn->send(chunk, chunk->data(), chunk->size());
+    conn->set_send_complete_handler([sent, chunk](const angel::connection_ptr& conn){
+            send_chunk(conn, sent, chunk);
+            });
+}
+
+static void run_once(const char *name, bool ktls, int file_fd)
+{
+    angel::evloop loop;
+    angel::evloop *server_loop = nullptr;
+    angel::server *server = nullptr;
+    std::promise<void> started;
+    std::atomic<size_t> total(0);
+    std::atomic<int64_t> start(0);
+    size_t expected = file_size * rounds * num_conns;
+
+    auto receive = [&](angel::buffer& buf){
+        if (start == 0) start = angel::util::get_cur_time_us();
+        total += buf.readable();
+        buf.retrieve_all();
+        if (total >= expected) loop.quit();
+    };
+
+    std::thread server_thread([&]{
+            angel::evloop loop;
+            angel::ssl_server serv(&loop, angel::inet_addr(port));
+            serv.set_certificate_file(cert_file.c_str());
+            serv.set_private_key_file(key_file.c_str());
+            serv.set_ktls(ktls);
+            serv.set_connection_handler([file_fd](const angel::connection_ptr& conn){
+                    if (upload) return;
+                    for (int i = 0; i < rounds; i++) {
+                        conn->send_file(file_fd, 0, file_size);
+                    }
+                    });
+            serv.set_message_handler([&](const angel::connection_ptr& conn, angel::buffer& buf){
+                    receive(buf);
+                    });
+            serv.start();
+            server_loop = &loop;
+            server = &serv;
+            started.set_value();
+            loop.run();
+            });
+    started.get_future().wait();
+
+    auto chunk = std::make_shared<std::string>(1024 * 1024, 'x');
+    std::vector<std::unique_ptr<angel::ssl_client>> clients;
+    std::vector<size_t> sent(num_conns);
+    for (int i = 0; i < num_conns; i++) {
+        clients.emplace_back(new angel::ssl_client(&loop, angel::inet_addr("127.0.0.1", port)));
+        auto& cli = clients.back();
+        cli->set_connection_handler([&, i](const angel::connection_ptr& conn){
+                if (!upload) return;
+                for (int k = 0; k < 4; k++) {
+                    send_chunk(conn, &sent[i], chunk);
+                }
+                });
+        cli->set_message_handler([&](const angel::connection_ptr& conn, angel::buffer& buf){
+                receive(buf);
+                });
+        cli->set_connection_failure_handler([&loop]{
+                fprintf(stderr, "### Handshake failed\n");
+                loop.quit();
+                });
+        cli->start();
+    }
+    loop.run();
+    int64_t end = angel::util::get_cur_time_us();
+
+    double secs = (end - start) / 1e6;
+    printf("%-8s %-8s %8.2f MB/s (%zu bytes in %.2f s)\n", name, upload ? "upload" : "download",
+           total / secs / 1024 / 1024, total.load(), secs);
+    fflush(stdout);
+
+    // The channels are removed in the loop.
+    clients.clear();
+    loop.run_after(100, [&loop]{ loop.quit(); });
+    loop.run();
+    // All connections must be closed before the server is destroyed.
+    while (server->get_connection_nums() > 0) usleep(1000);
+    server_loop->quit();
+    server_thread.join();
+    port++;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "C:K:c:s:n:p:u")) != -1) {
+        switch (c) {
+        case 'C':
+            cert_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        case 'c':
+            num_conns = atoi(optarg);
+            break;
+        case 's':
+            file_size = atol(optarg) * 1024 * 1024;
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            upload = true;
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            exit(1);
+        }
+    }
+    if (cert_file.empty() || key_file.empty()) {
+        fprintf(stderr, "Usage: ./bench_tls -C cert.pem -K key.pem "
+                        "[-c conns] [-s file size (MB)] [-n rounds] [-p port] [-u]\n");
+        exit(1);
+    }
+
+    char name[] = "/tmp/bench_tls.XXXXXX";
+    int file_fd = mkstemp(name);
+    unlink(name);
+    std::string block(1024 * 1024, 'x');
+    for (size_t i = 0; i < file_size; i += block.size()) {
+        write(file_fd, block.data(), std::min(block.size(), file_size - i));
+    }
+
+    run_once("BIO", false, file_fd);
+    run_once("kTLS", true, file_fd);
+
+    close(file_fd);
+    exit(0);
+}
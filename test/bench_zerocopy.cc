@@ -0,0 +1,176 @@
+//
+// Compare the throughput of sending a large cached payload
+// by write(2) (copy) and by MSG_ZEROCOPY.
+//
+// The server keeps a few sends of the same payload in flight for every
+// connection, the next one is sent in the send complete handler,
+// and the clients read as fast as possible.
+//
+// Note that on loopback the kernel has to copy the data to the receiver
+// anyway, so the gain is only significant over a real NIC.
+//
+// With -u the server uses io_uring, which doesn't support MSG_ZEROCOPY,
+// so the second run must fall back to the io_uring sends and complete.
+//
+
+#include <angel/server.h>
+#include <angel/sockops.h>
+#include <angel/util.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <future>
+#include <vector>
+
+static int num_conns        = 4;
+static size_t payload_size  = 1024 * 1024;
+static size_t total_size    = 512 * 1024 * 1024; // per connection
+static size_t threshold     = 16 * 1024;
+static int in_flight        = 4;
+static int port             = 18100;
+static angel::evloop_options loop_ops;
+
+struct sender {
+    size_t sent = 0;
+};
+
+static void send_next(const angel::connection_ptr& conn, sender *s,
+                      const std::shared_ptr<std::string>& payload)
+{
+    if (s->sent >= total_size) return;
+    s->sent += payload->size();
+    conn->send(payload, payload->data(), payload->size());
+    conn->set_send_complete_handler([s, payload](const angel::connection_ptr& conn){
+            send_next(conn, s, payload);
+            });
+}
+
+static double cpu_time()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void run_once(const char *name, size_t zerocopy_threshold)
+{
+    auto payload = std::make_shared<std::string>(payload_size, 'x');
+    std::vector<sender> senders(num_conns);
+    angel::evloop *main_loop = nullptr;
+    angel::server *server = nullptr;
+    std::promise<void> started;
+    std::atomic_int conns(0);
+
+    std::thread server_thread([&]{
+            angel::evloop loop(loop_ops);
+            angel::server serv(&loop, angel::inet_addr(port));
+            serv.set_zerocopy(zerocopy_threshold);
+            serv.set_connection_handler([&](const angel::connection_ptr& conn){
+                    auto *s = &senders[conns++];
+                    for (int i = 0; i < in_flight; i++) {
+                        send_next(conn, s, payload);
+                    }
+                    });
+            serv.start();
+            main_loop = &loop;
+            server = &serv;
+            started.set_value();
+            loop.run();
+            });
+    started.get_future().wait();
+
+    std::vector<struct pollfd> fds;
+    for (int i = 0; i < num_conns; i++) {
+        angel::inet_addr addr("127.0.0.1", port);
+        int fd = angel::sockops::socket();
+        if (angel::sockops::connect(fd, &addr.addr()) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        angel::sockops::set_nonblock(fd);
+        fds.push_back({ fd, POLLIN, 0 });
+    }
+
+    auto cpu1 = cpu_time();
+    auto t1 = angel::util::get_cur_time_us();
+    std::vector<char> buf(256 * 1024);
+    size_t total = 0, expected = 0;
+    for (int i = 0; i < num_conns; i++) {
+        expected += (total_size + payload_size - 1) / payload_size * payload_size;
+    }
+    while (total < expected) {
+        if (poll(fds.data(), fds.size(), 5000) <= 0) {
+            fprintf(stderr, "### Timed out\n");
+            break;
+        }
+        for (auto& pfd : fds) {
+            if (!(pfd.revents & POLLIN)) continue;
+            ssize_t n;
+            while ((n = read(pfd.fd, buf.data(), buf.size())) > 0) total += n;
+        }
+    }
+    auto t2 = angel::util::get_cur_time_us();
+    auto cpu2 = cpu_time();
+
+    double secs = (t2 - t1) / 1e6;
+    printf("%-14s %8.2f MB/s, cpu %.2f s per GB (server + client)\n",
+           name, total / secs / 1024 / 1024, (cpu2 - cpu1) / (total / 1e9));
+    fflush(stdout);
+
+    for (auto& pfd : fds) close(pfd.fd);
+    // All connections must be closed before the server is destroyed.
+    for (int i = 0; server->get_connection_nums() > 0; i++) {
+        if (i == 5000) {
+            fprintf(stderr, "### The connections of the server are not closed\n");
+            exit(1);
+        }
+        usleep(1000);
+    }
+    main_loop->quit();
+    server_thread.join();
+    port++;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "c:s:n:z:f:p:u")) != -1) {
+        switch (c) {
+        case 'c':
+            num_conns = atoi(optarg);
+            break;
+        case 's':
+            payload_size = atol(optarg);
+            break;
+        case 'n':
+            total_size = atol(optarg) * 1024 * 1024;
+            break;
+        case 'z':
+            threshold = atol(optarg);
+            break;
+        case 'f':
+            in_flight = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            loop_ops.use_io_uring = true;
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            fprintf(stderr, "Usage: ./bench_zerocopy [-c conns] [-s payload_size] "
+                            "[-n MB per conn] [-z threshold] [-f sends in flight] [-p port] [-u]\n");
+            exit(1);
+        }
+    }
+
+    run_once("write", 0);
+    run_once("MSG_ZEROCOPY", threshold);
+
+    exit(0);
+}
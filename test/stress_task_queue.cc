@@ -0,0 +1,102 @@
+//
+// Stress task_queue with producers racing the consumer.
+//
+// In each round, the producers push their tasks while the consumer
+// keeps calling run(). After the producers have finished, one run()
+// must execute everything left, and the queue must be empty() then.
+// A task stuck in the queue would also make the quit drain of evloop
+// spin forever.
+//
+
+#include <angel/task_queue.h>
+
+#include <unistd.h>
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+static int num_rounds    = 10000;
+static int num_producers = 3;
+static int num_tasks     = 16;
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "r:p:t:")) != -1) {
+        switch (c) {
+        case 'r':
+            num_rounds = atoi(optarg);
+            break;
+        case 'p':
+            num_producers = atoi(optarg);
+            break;
+        case 't':
+            num_tasks = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            fprintf(stderr, "Usage: ./stress_task_queue [-r rounds] [-p producers] [-t tasks]\n");
+            exit(1);
+        }
+    }
+
+    // A small capacity, so that the heap nodes are also exercised.
+    angel::task_queue queue(num_producers * num_tasks / 2);
+    size_t executed = 0, expected = 0;
+    int failures = 0;
+
+    // The producers start a round when round is increased,
+    // and decrease running when they have pushed their tasks.
+    std::atomic_int round(0), running(0);
+    std::vector<std::thread> producers;
+    for (int i = 0; i < num_producers; i++) {
+        producers.emplace_back([&]{
+                for (int r = 1; r <= num_rounds; r++) {
+                    while (round.load() < r) std::this_thread::yield();
+                    for (int j = 0; j < num_tasks; j++) {
+                        queue.push([&executed]{ executed++; });
+                    }
+                    running--;
+                }
+                });
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    int r = 1;
+    for (; r <= num_rounds; r++) {
+        running = num_producers;
+        round = r;
+        while (running > 0) {
+            queue.run();
+        }
+        queue.run();
+        expected += num_producers * num_tasks;
+        if (!queue.empty() || executed != expected) {
+            fprintf(stderr, "### Round %d: empty() = %d, executed %zu of %zu\n",
+                    r, queue.empty(), executed, expected);
+            failures++;
+            // Catch up, so that the next rounds are checked alone.
+            for (int i = 0; i < 1000 && !queue.empty(); i++) queue.run();
+            if (failures >= 10 || !queue.empty()) {
+                if (!queue.empty()) fprintf(stderr, "### A task is stuck in the queue\n");
+                break;
+            }
+            executed = expected;
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    if (r <= num_rounds) {
+        // Let the producers run out.
+        round = num_rounds;
+        for (auto& t : producers) t.detach();
+    } else {
+        for (auto& t : producers) t.join();
+    }
+
+    printf("rounds: %d, producers: %d, tasks: %d, failures: %d, %.2f s\n",
+           std::min(r, num_rounds), num_producers, num_tasks, failures,
+           std::chrono::duration<double>(t2 - t1).count());
+    if (failures > 0) _exit(1);
+}